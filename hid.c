@@ -17,6 +17,9 @@
 
 #include "hid.h"
 #include "system.h"
+#include "timer.h"
+
+#include <avr/interrupt.h>
 
 /* The protocol the keyboard is using at the moment */
 static volatile uint8_t keyboard_protocol = REPORT_PROTOCOL;
@@ -30,6 +33,12 @@ static volatile uint16_t keyboard_idle_countdown=500;
 
 static volatile bool keyboard_send_now = false;
 
+/* the time the last report was handed to the USB controller */
+static volatile uint32_t report_time = 0;
+/* the number of reports handed to the USB controller, wrapping around; every
+ * one of them reaches the host, as none is replaced before it is taken */
+static volatile uint8_t reports_sent = 0;
+
 // 1=num lock, 2=caps lock, 4=scroll lock, 8=compose, 16=kana
 static volatile uint8_t keyboard_leds = 0;
 static volatile bool leds_changed = false;
@@ -112,12 +121,15 @@ void HID_handle_sof(void *data)
 	if (!should_send)
 		return;
 	USB_set_endpoint(KEYBOARD_ENDPOINT);
-	/* substitute data to be sent with new version if last buffer has not
-	 * been sent */
+	/* the host has not taken the last report yet; replacing it would lose
+	 * a state it may never see, and reports_sent would count it, so the
+	 * current state is sent in a later frame instead */
 	if (!USB_IN_ready())
-		USB_kill_banks();
+		return;
 	HID_send_report();
 	USB_flush_IN();
+	report_time = TIMER_get_ticks();
+	++reports_sent;
 	keyboard_send_now = false;
 	keyboard_idle_countdown = keyboard_idle_config;
 }
@@ -171,6 +183,25 @@ void HID_commit_state()
 	keyboard_send_now = true;
 }
 
+uint32_t HID_get_report_time()
+{
+	uint8_t sreg = SREG;
+	cli();
+	uint32_t time = report_time;
+	SREG = sreg;
+	return time;
+}
+
+uint8_t HID_get_modifiers()
+{
+	return key_map[28];
+}
+
+uint8_t HID_get_reports_sent()
+{
+	return reports_sent;
+}
+
 uint8_t HID_get_leds()
 {
 	return keyboard_leds;
@@ -28,6 +28,14 @@ void HID_handle_sof();
 void HID_init();
 bool HID_scancode_is_pressed(uint8_t code);
 void HID_set_scancode_state(uint8_t code, bool state);
+/* returns the time (in TIMER ticks) at which the last report was sent */
+uint32_t HID_get_report_time();
+/* returns the modifier byte of the report */
+uint8_t HID_get_modifiers();
+/* returns the number of reports sent so far, wrapping around; a report is
+ * counted once it is handed to the USB controller, and it is never replaced
+ * before the host takes it */
+uint8_t HID_get_reports_sent();
 uint8_t HID_get_leds();
 void HID_commit_state();
 uint8_t HID_leds_changed();
@@ -0,0 +1,51 @@
+/* This file is part of ukbdc.
+ *
+ * ukbdc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ukbdc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ukbdc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "keyqueue.h"
+
+static volatile struct key_event queue[KEYQUEUE_SIZE];
+/* written only by the producer */
+static volatile uint8_t head = 0;
+/* written only by the consumer */
+static volatile uint8_t tail = 0;
+
+bool KEYQUEUE_push(uint8_t key, bool state, uint32_t time)
+{
+	const uint8_t h = head;
+	if ((uint8_t)(h - tail) == KEYQUEUE_SIZE)
+		return false;
+	volatile struct key_event *event = &queue[h & (KEYQUEUE_SIZE - 1)];
+	event->time = time;
+	event->key = key;
+	event->state = state;
+	/* publish the event only after it has been written */
+	head = h + 1;
+	return true;
+}
+
+bool KEYQUEUE_pop(struct key_event *event)
+{
+	const uint8_t t = tail;
+	if (t == head)
+		return false;
+	const volatile struct key_event *e = &queue[t & (KEYQUEUE_SIZE - 1)];
+	event->time = e->time;
+	event->key = e->key;
+	event->state = e->state;
+	tail = t + 1;
+	return true;
+}
@@ -0,0 +1,68 @@
+/* This file is part of ukbdc.
+ *
+ * ukbdc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ukbdc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ukbdc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*! \defgroup KEYQUEUE
+ * \brief Lock-free queue of key events
+ *
+ * This module decouples scanning the key matrix from processing the key
+ * events. The scanning side pushes key events, timestamped when the key was
+ * read, into a ring buffer and the layout processing side pops them in a
+ * SYSTEM task, so layer changes and other layout work never stretch a scan.
+ *
+ * The queue has a single producer and a single consumer. The producer only
+ * writes the head index and the consumer only writes the tail index, both a
+ * single byte wide, so no locking is needed and the producer can run in an
+ * interrupt handler. When the queue is full, KEYQUEUE_push() fails and the
+ * MATRIX module reports the change again in its next scan, so no event is
+ * lost.
+ *
+ * @{
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*! Number of events the queue can hold (a power of 2) */
+#define KEYQUEUE_SIZE 16
+
+/*! A single key state change */
+struct key_event {
+	/*! Time at which the key was read, in TIMER ticks */
+	uint32_t time;
+	/*! Key number */
+	uint8_t key;
+	/*! New state of the key */
+	bool state;
+};
+
+/*! Adds an event to the queue. This function has the signature of \ref
+ * matrix_callback_t, so it can be passed directly to MATRIX_init().
+ * \param key key number
+ * \param state new state of the key
+ * \param time time of the event in TIMER ticks
+ * \return `true` on success, `false` if the queue is full
+ */
+bool KEYQUEUE_push(uint8_t key, bool state, uint32_t time);
+/*! Removes the oldest event from the queue
+ * \param event structure to fill with the event
+ * \return `true` on success, `false` if the queue is empty
+ */
+bool KEYQUEUE_pop(struct key_event *event);
+
+/*! @} */
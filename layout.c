@@ -17,51 +17,734 @@
 
 #include "layout.h"
 #include "auxiliary.h"
+#include "timer.h"
 
 #include <avr/pgmspace.h>
+#include <string.h>
 
-/* pointer to program space */
+/* pointers to program space */
+static const uint8_t *layout_start = NULL;
+/* all the layers of a dense layout, or the base layer of an extended one */
 static const struct layout_key *data = NULL;
+/* the upper layers of an extended layout */
+static const struct layout_run *runs = NULL;
+static bool extended = false;
 static struct layout_state state = {
 	.last_scancode = NULL,
 	.active = false
 };
-static struct layout_key *layer_cache = NULL;
 static scancode_callback_t scancode_callback = NULL;
+static modifiers_callback_t modifiers_callback = NULL;
 
-void load_layer(uint8_t num)
+/* the time after which a tap-hold key is held, in TIMER ticks */
+#define TAP_TICKS ((uint32_t)LAYOUT_TAP_TIME * TIMER_TICKS_PER_MS)
+/* the number of events which can wait for a tap-hold key to be resolved */
+#define TAP_HOLD_BUFFER 8
+
+/*! A key event waiting for a tap-hold key to be resolved */
+struct held_event {
+	uint8_t key;
+	bool event;
+	uint32_t time;
+};
+
+/*! The state of tap-hold keys */
+static struct {
+	/*! Indicates whether a tap-hold key waits to be resolved */
+	bool pending;
+	/*! The key waiting to be resolved */
+	uint8_t key;
+	/*! Its description, as resolved when it was pressed */
+	struct layout_key desc;
+	/*! The time it was pressed */
+	uint32_t time;
+	/*! Events which happened since it was pressed */
+	uint8_t nbuf;
+	struct held_event buf[TAP_HOLD_BUFFER];
+} tap_hold;
+
+/* the number of scancode releases which can wait for a report */
+#define RELEASE_SLOTS 8
+/* the number of presses remembered until they have surely been reported */
+#define FRESH_SLOTS 8
+
+/*! Scancode releases waiting for the press to be reported. A key pressed and
+ * released before a report is sent, e.g. when the events held back by a
+ * tap-hold key are replayed at once, would never reach the host otherwise.
+ * Releases of scancodes whose press has been reported are done at once. */
+static struct {
+	/*! Scancodes pressed recently, with the report counter seen by the
+	 * last LAYOUT_poll() before each press */
+	uint8_t nfresh;
+	uint8_t fresh[FRESH_SLOTS];
+	uint8_t fresh_reports[FRESH_SLOTS];
+	/*! The report counter seen by the last LAYOUT_poll() */
+	uint8_t last_reports;
+	/*! Releases waiting to be armed by LAYOUT_poll() */
+	uint8_t nwaiting;
+	uint8_t waiting[RELEASE_SLOTS];
+	/*! Releases done by LAYOUT_poll() once a report has been sent */
+	uint8_t narmed;
+	uint8_t armed[RELEASE_SLOTS];
+	/*! The report counter when they were armed */
+	uint8_t reports;
+} release;
+
+/* the time in which the keys of a combo have to be pressed, in TIMER ticks */
+#define COMBO_TICKS ((uint32_t)LAYOUT_COMBO_TIME * TIMER_TICKS_PER_MS)
+/* the number of key presses which can be held back by a combo */
+#define COMBO_HELD 8
+
+/* the combos of the layout in program space, NULL if there are none */
+static const struct layout_combo *combos = NULL;
+/* for every key, the number of its bit in combo masks plus one, or 0 */
+static uint8_t *combo_bit = NULL;
+/* for every combo key, the combos which contain it */
+static uint32_t key_combos[LAYOUT_MAX_COMBO_KEYS];
+
+/*! The state of combo detection */
+static struct {
+	/*! Combo keys pressed and held back, as a combo mask */
+	uint32_t pressed;
+	/*! Combos which contain all the pressed keys */
+	uint32_t candidates;
+	/*! The presses held back, in order */
+	uint8_t nheld;
+	struct held_event held[COMBO_HELD];
+	/*! Keys of the last combo which are still pressed */
+	uint32_t active;
+	/*! The last combo */
+	uint8_t active_combo;
+	/*! The first key of the last combo, which owns its actions */
+	uint8_t owner;
+	/*! Indicates whether the last combo has been released */
+	bool released;
+} combo;
+
+/* the mod-morph rules in use in program space, NULL if there are none */
+static const struct layout_morphs *morphs = NULL;
+/* the rules used when no layout brings its own, NULL if there are none */
+static const struct layout_morphs *default_morphs = NULL;
+/* scancodes which have mod-morph rules, one bit each */
+static uint8_t morphed[32];
+
+/* the macros of the layout in program space, NULL if there are none */
+static const struct layout_macros *macros = NULL;
+static uint8_t num_macros = 0;
+
+/*! The state of the macro player */
+static struct {
+	/*! The next step of the macro being played, NULL if none is */
+	const uint8_t *pos;
+	/*! The scancode tapped in the last step, released in the next one */
+	uint8_t tap_code;
+	/*! Indicates whether the last step waits to be reported */
+	bool waiting;
+	/*! The report counter after the last step */
+	uint8_t reports;
+} macro;
+
+/* the time after the last key of a leader sequence after which it ends, in
+ * TIMER ticks */
+#define LEADER_TICKS ((uint32_t)LAYOUT_LEADER_TIME * TIMER_TICKS_PER_MS)
+
+/* the leader sequences of the layout in program space, NULL if there are
+ * none */
+static const struct layout_leader *leader_trie = NULL;
+static const struct layout_key *leader_results = NULL;
+/* the number of slots of the trie, so a transition reads only its slot */
+static uint16_t leader_slots = 0;
+/* stored in momentary[] for keys pressed as a part of a leader sequence, which
+ * do nothing when released */
+#define LEADER_CONSUMED 0xff
+
+/*! The state of leader sequence matching */
+static struct {
+	/*! Indicates whether a sequence is being matched */
+	bool active;
+	/*! The leader key, which owns the actions of the results */
+	uint8_t key;
+	/*! The slot of the current state */
+	uint16_t node;
+	/*! Its base, so that a transition takes a single read */
+	uint16_t base;
+	/*! The time of the last key of the sequence */
+	uint32_t time;
+} leader;
+
+/* Returns the program space address of a section of an extended layout, or
+ * NULL if there is no such section */
+static const void *get_section(uint8_t n)
+{
+	const struct layout_ext *ext = (const struct layout_ext*)layout_start;
+	if (!extended)
+		return NULL;
+	if (n >= get_pgm_struct_field(ext, num_sections))
+		return NULL;
+	const uint16_t offset = pgm_read_word(&ext->sections[n]);
+	return offset ? layout_start + offset : NULL;
+}
+
+/* Binary searches the run of an upper layer of an extended layout for a key,
+ * returns the dword describing it or 0 if it is transparent */
+static uint32_t find_sparse_key(uint8_t layer, uint8_t key)
+{
+	const struct layout_run *run = runs + layer - 1;
+	const struct layout_sparse_key *keys = (const struct layout_sparse_key*)
+		(layout_start + get_pgm_struct_field(run, offset));
+	uint8_t lo = 0, hi = get_pgm_struct_field(run, count);
+	while (lo < hi) {
+		const uint8_t mid = (lo + hi) / 2;
+		const uint8_t k = get_pgm_struct_field(keys + mid, key);
+		if (k == key)
+			return pgm_read_dword(&keys[mid].desc);
+		if (k < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return 0;
+}
+
+/* Reads the description of a key on a layer from program space. A single
+ * dword read is cheaper than looking the key up in any cache, so the keys are
+ * resolved only when they change state. */
+static struct layout_key get_key(uint8_t layer, uint8_t key)
+{
+	uint32_t dword;
+	if (extended && layer > 0)
+		dword = find_sparse_key(layer, key);
+	else
+		dword = pgm_read_dword(data + layer*state.num_keys + key);
+	return *(struct layout_key*)&dword;
+}
+
+static void load_layer(uint8_t num)
+{
+	/* a relative jump may be taken from a layer other than its own */
+	if (num < state.num_layers)
+		state.cur_layer = num;
+}
+
+/* returns the number of the highest bit set in a non-zero mask */
+static uint8_t highest_bit(uint16_t mask)
+{
+	uint8_t n = 0;
+	if (mask & 0xff00) {
+		n += 8;
+		mask >>= 8;
+	}
+	if (mask & 0xf0) {
+		n += 4;
+		mask >>= 4;
+	}
+	if (mask & 0x0c) {
+		n += 2;
+		mask >>= 2;
+	}
+	if (mask & 0x02)
+		n += 1;
+	return n;
+}
+
+/* Finds the topmost active layer which defines the key.
+ * Returns false if no active layer does. */
+static bool resolve_key(uint8_t key, struct layout_key *k)
+{
+	const uint16_t active = state.layers | ((uint16_t)1 << state.cur_layer);
+	const uint16_t mask = active & state.defined[key];
+	if (!mask)
+		return false;
+	*k = get_key(highest_bit(mask), key);
+	return true;
+}
+
+static void act_none(__attribute__((unused)) uint8_t key,
+		__attribute__((unused)) uint8_t arg)
+{
+}
+
+static void act_rel(__attribute__((unused)) uint8_t key, uint8_t arg)
+{
+	load_layer(state.cur_layer + (int8_t)arg);
+}
+
+static void act_abs(__attribute__((unused)) uint8_t key, uint8_t arg)
+{
+	load_layer(arg);
+}
+
+static void act_mo(uint8_t key, uint8_t arg)
+{
+	state.layers |= (uint16_t)1 << arg;
+	state.momentary[key] = arg + 1;
+}
+
+static void act_tg(__attribute__((unused)) uint8_t key, uint8_t arg)
+{
+	state.layers ^= (uint16_t)1 << arg;
+}
+
+static void act_osl(__attribute__((unused)) uint8_t key, uint8_t arg)
+{
+	state.layers |= (uint16_t)1 << arg;
+	state.oneshot |= (uint16_t)1 << arg;
+}
+
+static void act_macro(__attribute__((unused)) uint8_t key, uint8_t arg)
+{
+	/* a macro is not interrupted by another one */
+	if (macro.pos)
+		return;
+	macro.pos = layout_start + pgm_read_word(&macros->offsets[arg]);
+	macro.tap_code = 0;
+	macro.waiting = false;
+}
+
+typedef void (*action_t)(uint8_t key, uint8_t arg);
+
+/* Layer actions by type. The types are checked in LAYOUT_set(), so they are
+ * dispatched without any further checks; the table covers the whole nibble
+ * anyway, so a layout corrupted while active cannot jump anywhere. */
+static const action_t actions[16] = {
+	[NONE] = act_none,
+	[REL] = act_rel,
+	[ABS] = act_abs,
+	[MO] = act_mo,
+	[TG] = act_tg,
+	[OSL] = act_osl,
+	/* tap-hold keys are handled before dispatching */
+	[HT_KEY] = act_none,
+	[HT_LAYER] = act_none,
+	[MACRO] = act_macro,
+	/* so is the leader key */
+	[LEADER] = act_none,
+	[NUM_ACTIONS ... 15] = act_none,
+};
+
+/* Checks a single action of a key defined on a layer */
+static bool check_action(uint8_t layer, uint8_t type, uint8_t arg)
+{
+	switch (type) {
+	case NONE:
+		return true;
+	case REL:
+		return (uint8_t)(layer + (int8_t)arg) < state.num_layers;
+	case ABS:
+	case MO:
+	case TG:
+	case OSL:
+		return arg < state.num_layers;
+	case MACRO:
+		return arg < num_macros;
+	default:
+		return false;
+	}
+}
+
+/* Checks the up action of a key. Momentary and one-shot layers are only
+ * activated by down actions, as nothing would ever deactivate them. */
+static bool check_up_action(uint8_t layer, uint8_t type, uint8_t arg)
+{
+	return type != MO && type != OSL && check_action(layer, type, arg);
+}
+
+/* Checks a key defined on a layer and marks the layer as defining it */
+static int compile_key(uint8_t layer, uint8_t key, uint32_t dword)
+{
+	if (!dword)
+		return 0;
+	const struct layout_key k = *(struct layout_key*)&dword;
+	const uint8_t down = k.actions >> 4;
+	if (down == LEADER) {
+		if (!leader_trie)
+			return LAYOUT_EACTION;
+	} else if (down == HT_KEY || down == HT_LAYER) {
+		/* the up action holds the policy of a tap-hold key */
+		if ((k.actions & 0x0f) != NONE ||
+				(down == HT_LAYER && k.down_arg >= state.num_layers))
+			return LAYOUT_EACTION;
+	} else if (!check_action(layer, down, k.down_arg) ||
+			!check_up_action(layer, k.actions & 0x0f, k.up_arg)) {
+		return LAYOUT_EACTION;
+	}
+	state.defined[key] |= (uint16_t)1 << layer;
+	return 0;
+}
+
+/* Checks that every macro of an extended layout ends within
+ * LAYOUT_MAX_MACRO_STEPS steps and has only known steps */
+static int compile_macros()
+{
+	macros = get_section(LAYOUT_SECTION_MACROS);
+	num_macros = 0;
+	if (!macros)
+		return 0;
+	const uint8_t n = get_pgm_struct_field(macros, num_macros);
+	for (uint8_t i = 0; i < n; ++i) {
+		const uint16_t offset = pgm_read_word(&macros->offsets[i]);
+		if (!offset)
+			return LAYOUT_EFORMAT;
+		const uint8_t *step = layout_start + offset;
+		uint16_t j;
+		for (j = 0; j < LAYOUT_MAX_MACRO_STEPS; ++j, step += 2) {
+			const uint8_t op = pgm_read_byte(step);
+			if (op == MACRO_END)
+				break;
+			if (op > MACRO_TAP)
+				return LAYOUT_EFORMAT;
+		}
+		if (j == LAYOUT_MAX_MACRO_STEPS)
+			return LAYOUT_EFORMAT;
+	}
+	num_macros = n;
+	return 0;
+}
+
+/* Checks mod-morph rules and starts using them, marking the scancodes which
+ * have any. No rules are used if they are wrong. */
+static int load_morphs(const struct layout_morphs *rules)
+{
+	memset(morphed, 0, sizeof(morphed));
+	morphs = NULL;
+	if (!rules)
+		return 0;
+	const uint8_t n = get_pgm_struct_field(rules, num_morphs);
+	for (uint8_t i = 0; i < n; ++i) {
+		const struct layout_morph *m = &rules->morphs[i];
+		const uint8_t code = get_pgm_struct_field(m, scode);
+		if (!code || !get_pgm_struct_field(m, mods)) {
+			memset(morphed, 0, sizeof(morphed));
+			return LAYOUT_EFORMAT;
+		}
+		morphed[code >> 3] |= (1 << (code & 0x07));
+	}
+	morphs = rules;
+	return 0;
+}
+
+/* Uses the mod-morph rules of an extended layout, or the default ones if it
+ * has none */
+static int compile_morphs()
+{
+	const struct layout_morphs *section =
+		get_section(LAYOUT_SECTION_MORPHS);
+	return load_morphs(section ? section : default_morphs);
+}
+
+/* Checks the leader sequences of an extended layout: every used slot has to
+ * point at a parent before it and a result which exist, so every transition
+ * leads further into the slots and a sequence always ends. The results are
+ * tapped, so they cannot be held. */
+static int compile_leader()
 {
-	for (int i = 0; i < state.num_keys; ++i) {
-		uint32_t dword = pgm_read_dword(data + num*state.num_keys + i);
-		layer_cache[i] = *(struct layout_key*)&dword;
+	leader_trie = get_section(LAYOUT_SECTION_LEADER);
+	if (!leader_trie)
+		return 0;
+	const uint16_t num_slots = get_pgm_struct_field(leader_trie, num_slots);
+	const uint8_t num_results = get_pgm_struct_field(leader_trie,
+			num_results);
+	if (num_slots == 0)
+		goto error;
+	const uint32_t root = pgm_read_dword(leader_trie->slots);
+	const struct layout_leader_slot r = *(struct layout_leader_slot*)&root;
+	/* a base of 0 would make the root its own child */
+	if (r.check != LEADER_EMPTY || r.base == 0 || (r.base & LEADER_LEAF))
+		goto error;
+	for (uint16_t i = 1; i < num_slots; ++i) {
+		const uint32_t dword = pgm_read_dword(&leader_trie->slots[i]);
+		const struct layout_leader_slot slot =
+			*(struct layout_leader_slot*)&dword;
+		if (slot.check == LEADER_EMPTY)
+			continue;
+		if (slot.check >= i || ((slot.base & LEADER_LEAF) &&
+				(slot.base & ~LEADER_LEAF) >= num_results))
+			goto error;
 	}
-	state.cur_layer = num;
+	leader_results = (const struct layout_key*)
+		(leader_trie->slots + num_slots);
+	leader_slots = num_slots;
+	for (uint8_t i = 0; i < num_results; ++i) {
+		const uint32_t dword = pgm_read_dword(leader_results + i);
+		const struct layout_key k = *(struct layout_key*)&dword;
+		const uint8_t down = k.actions >> 4;
+		if (down == HT_KEY || down == HT_LAYER || down == LEADER ||
+				down == MO || (k.actions & 0x0f) != NONE ||
+				!check_action(0, down, k.down_arg)) {
+			leader_trie = NULL;
+			return LAYOUT_EACTION;
+		}
+	}
+	return 0;
+error:
+	leader_trie = NULL;
+	return LAYOUT_EFORMAT;
+}
+
+/* Checks the combos section of an extended layout and builds the tables
+ * which map keys to combo mask bits and combo keys to combos */
+static int compile_combos()
+{
+	memset(combo_bit, 0, state.num_keys);
+	const struct layout_combos *section = get_section(LAYOUT_SECTION_COMBOS);
+	combos = NULL;
+	if (!section)
+		return 0;
+	const uint8_t num_keys = get_pgm_struct_field(section, num_keys);
+	const uint8_t num_combos = get_pgm_struct_field(section, num_combos);
+	if (num_keys > LAYOUT_MAX_COMBO_KEYS || num_combos > LAYOUT_MAX_COMBOS)
+		return LAYOUT_EFORMAT;
+	for (uint8_t j = 0; j < num_keys; ++j) {
+		const uint8_t key = pgm_read_byte(&section->keys[j]);
+		if (key >= state.num_keys || combo_bit[key])
+			return LAYOUT_EFORMAT;
+		combo_bit[key] = j + 1;
+		key_combos[j] = 0;
+	}
+	const struct layout_combo *list = (const struct layout_combo*)
+		(section->keys + num_keys);
+	for (uint8_t i = 0; i < num_combos; ++i) {
+		const uint32_t mask = get_pgm_struct_field(list + i, mask);
+		/* a combo needs at least two keys, all of them listed */
+		if (!(mask & (mask - 1)) ||
+				(num_keys < 32 && mask >> num_keys))
+			return LAYOUT_EFORMAT;
+		const uint32_t dword = pgm_read_dword(&list[i].desc);
+		const struct layout_key k = *(struct layout_key*)&dword;
+		const uint8_t down = k.actions >> 4;
+		if (down == HT_KEY || down == HT_LAYER || down == LEADER ||
+				!check_action(0, down, k.down_arg) ||
+				!check_up_action(0, k.actions & 0x0f, k.up_arg))
+			return LAYOUT_EACTION;
+		for (uint8_t j = 0; j < num_keys; ++j)
+			if ((mask >> j) & 0x01)
+				key_combos[j] |= (uint32_t)1 << i;
+	}
+	combos = list;
+	return 0;
+}
+
+/* Checks all the keys of the layout and finds the layers on which every key
+ * is not transparent */
+static int compile()
+{
+	int ret = compile_macros();
+	if (ret)
+		return ret;
+	ret = compile_morphs();
+	if (ret)
+		return ret;
+	/* before the keys, which may refer to it */
+	ret = compile_leader();
+	if (ret)
+		return ret;
+	memset(state.defined, 0, state.num_keys * sizeof(*state.defined));
+	const uint8_t dense = extended ? 1 : state.num_layers;
+	for (uint8_t l = 0; l < dense; ++l)
+		for (uint8_t i = 0; i < state.num_keys; ++i) {
+			ret = compile_key(l, i,
+				pgm_read_dword(data + l*state.num_keys + i));
+			if (ret)
+				return ret;
+		}
+	for (uint8_t l = dense; l < state.num_layers; ++l) {
+		const struct layout_run *run = runs + l - 1;
+		const struct layout_sparse_key *keys =
+			(const struct layout_sparse_key*)(layout_start +
+				get_pgm_struct_field(run, offset));
+		const uint8_t count = get_pgm_struct_field(run, count);
+		int prev = -1;
+		for (uint8_t j = 0; j < count; ++j) {
+			const uint8_t key = get_pgm_struct_field(keys + j, key);
+			/* the binary search needs strictly sorted keys */
+			if (key >= state.num_keys || key <= prev)
+				return LAYOUT_EFORMAT;
+			prev = key;
+			ret = compile_key(l, key,
+				pgm_read_dword(&keys[j].desc));
+			if (ret)
+				return ret;
+		}
+	}
+	return compile_combos();
 }
 
 int LAYOUT_init(int num_keys)
 {
 	state.num_keys = num_keys;
-	layer_cache = malloc(sizeof(*layer_cache) * num_keys);
 	state.last_scancode = malloc(num_keys);
+	memset(state.last_scancode, 0, num_keys);
+	state.momentary = malloc(num_keys);
+	memset(state.momentary, 0, num_keys);
+	state.defined = malloc(num_keys * sizeof(*state.defined));
+	combo_bit = malloc(num_keys);
+	memset(combo_bit, 0, num_keys);
 	return 0;
 }
 
+/* Removes a scancode from a list of releases, returns the new length */
+static uint8_t drop_release(uint8_t *list, uint8_t n, uint8_t code)
+{
+	for (uint8_t i = 0; i < n; ++i)
+		if (list[i] == code) {
+			list[i] = list[--n];
+			break;
+		}
+	return n;
+}
+
+/* Forgets a recent press, returns false if there was none */
+static bool drop_fresh(uint8_t code)
+{
+	for (uint8_t i = 0; i < release.nfresh; ++i)
+		if (release.fresh[i] == code) {
+			--release.nfresh;
+			release.fresh[i] = release.fresh[release.nfresh];
+			release.fresh_reports[i] =
+				release.fresh_reports[release.nfresh];
+			return true;
+		}
+	return false;
+}
+
+/* Releases a scancode, waiting for a report first if its press may not have
+ * been reported yet. The release is done at once if there are too many
+ * waiting. */
+static void release_scancode(uint8_t code)
+{
+	release.nwaiting = drop_release(release.waiting, release.nwaiting,
+			code);
+	if (!drop_fresh(code) || release.nwaiting == RELEASE_SLOTS) {
+		scancode_callback(code, UP);
+		return;
+	}
+	release.waiting[release.nwaiting++] = code;
+}
+
+/* Presses a scancode. A release of it which still waits is cancelled, so the
+ * scancode stays pressed rather than being released under the new press. */
+static void press(uint8_t code)
+{
+	release.nwaiting = drop_release(release.waiting, release.nwaiting,
+			code);
+	release.narmed = drop_release(release.armed, release.narmed, code);
+	drop_fresh(code);
+	/* with no room, the oldest presses are the likeliest to be reported */
+	if (release.nfresh == FRESH_SLOTS)
+		drop_fresh(release.fresh[0]);
+	release.fresh[release.nfresh] = code;
+	release.fresh_reports[release.nfresh] = release.last_reports;
+	++release.nfresh;
+	scancode_callback(code, DOWN);
+}
+
+/* Does all the waiting releases at once */
+static void flush_releases()
+{
+	for (uint8_t i = 0; i < release.narmed; ++i)
+		scancode_callback(release.armed[i], UP);
+	for (uint8_t i = 0; i < release.nwaiting; ++i)
+		scancode_callback(release.waiting[i], UP);
+	release.narmed = 0;
+	release.nwaiting = 0;
+	release.nfresh = 0;
+}
+
+/* Does the armed releases once a report has been sent since they were armed,
+ * and arms the waiting ones. Returns true if any scancode was released. */
+static bool poll_releases(uint8_t reports)
+{
+	bool changed = false;
+	/* a report may have left between the last poll and a press, so only
+	 * the second one after it surely contains the press */
+	release.last_reports = reports;
+	for (uint8_t i = 0; i < release.nfresh; )
+		if ((uint8_t)(reports - release.fresh_reports[i]) >= 2)
+			drop_fresh(release.fresh[i]);
+		else
+			++i;
+	if (release.narmed && reports != release.reports) {
+		for (uint8_t i = 0; i < release.narmed; ++i)
+			scancode_callback(release.armed[i], UP);
+		release.narmed = 0;
+		changed = true;
+	}
+	/* the presses are in the reports sent from now on */
+	if (!release.narmed && release.nwaiting) {
+		memcpy(release.armed, release.waiting, release.nwaiting);
+		release.narmed = release.nwaiting;
+		release.nwaiting = 0;
+		release.reports = reports;
+	}
+	return changed;
+}
+
 /* Sets current layout */
-int LAYOUT_set(const struct layout *layout)
+static int set_layout(const struct layout *layout)
 {
 	uint8_t num_keys = get_pgm_struct_field(layout, num_keys);
 	if (num_keys != state.num_keys)
-		return -1;
-	state.num_layers = get_pgm_struct_field(layout, num_layers);
+		return LAYOUT_EKEYS;
+	uint8_t num_layers = get_pgm_struct_field(layout, num_layers);
+	state.active = false;
+	layout_start = (const uint8_t*)layout;
+	extended = num_layers & LAYOUT_EXTENDED;
+	num_layers &= ~LAYOUT_EXTENDED;
 	data = layout->data;
+	if (extended) {
+		data = get_section(LAYOUT_SECTION_BASE);
+		runs = get_section(LAYOUT_SECTION_LAYERS);
+		if (!data || (num_layers > 1 && !runs))
+			return LAYOUT_EFORMAT;
+	}
+	if (num_layers == 0 || num_layers > LAYOUT_MAX_LAYERS)
+		return LAYOUT_EFORMAT;
+	state.num_layers = num_layers;
+	const int ret = compile();
+	if (ret)
+		return ret;
+	state.layers = 0;
+	state.oneshot = 0;
+	memset(state.momentary, 0, state.num_keys);
+	tap_hold.pending = false;
+	tap_hold.nbuf = 0;
+	if (scancode_callback)
+		flush_releases();
+	combo.nheld = 0;
+	combo.pressed = 0;
+	combo.active = 0;
+	macro.pos = NULL;
+	leader.active = false;
 	load_layer(0);
 	state.active = true;
 	return 0;
 }
 
+int LAYOUT_set(const struct layout *layout)
+{
+	const int ret = set_layout(layout);
+	/* the rules of a rejected layout must not outlive it */
+	if (ret)
+		load_morphs(default_morphs);
+	return ret;
+}
+
 void LAYOUT_deactivate()
 {
 	state.active = false;
+	load_morphs(default_morphs);
+}
+
+int LAYOUT_set_default_morphs(const struct layout_morphs *rules)
+{
+	default_morphs = rules;
+	/* an active layout with rules of its own keeps them */
+	if (state.active && get_section(LAYOUT_SECTION_MORPHS))
+		return 0;
+	const int ret = load_morphs(rules);
+	if (ret)
+		default_morphs = NULL;
+	return ret;
 }
 
 /* Sets the function which will be called each time a scancode should be
@@ -71,40 +754,392 @@ void LAYOUT_set_callback(scancode_callback_t callback)
 	scancode_callback = callback;
 }
 
-/* Sends a key press or key release event to layout */
-void LAYOUT_set_key_state(uint8_t key, bool event)
+void LAYOUT_set_modifiers_callback(modifiers_callback_t callback)
 {
-	if (!state.active)
+	modifiers_callback = callback;
+}
+
+static void handle_event(uint8_t key, bool event, uint32_t time);
+
+uint8_t LAYOUT_morph(uint8_t code, uint8_t mods)
+{
+	/* most scancodes have no rules, which takes a single bit test */
+	if (!(morphed[code >> 3] & (1 << (code & 0x07))))
+		return code;
+	const uint8_t n = get_pgm_struct_field(morphs, num_morphs);
+	for (uint8_t i = 0; i < n; ++i) {
+		const struct layout_morph *m = &morphs->morphs[i];
+		if (get_pgm_struct_field(m, scode) == code &&
+				(get_pgm_struct_field(m, mods) & mods))
+			return get_pgm_struct_field(m, replacement);
+	}
+	return code;
+}
+
+/* Returns the scancode a key sends when pressed with the current modifiers */
+static uint8_t press_code(uint8_t code)
+{
+	if (!modifiers_callback)
+		return code;
+	return LAYOUT_morph(code, modifiers_callback());
+}
+
+/* Presses a scancode, which is released once its press has been reported */
+static void tap(uint8_t code)
+{
+	press(code);
+	release_scancode(code);
+}
+
+/* Starts matching a leader sequence */
+static void start_leader(uint8_t key, uint32_t time)
+{
+	leader.active = true;
+	leader.key = key;
+	leader.node = 0;
+	leader.base = get_pgm_struct_field(leader_trie->slots, base);
+	leader.time = time;
+}
+
+/* Follows the transition from the current state of the leader sequence on a
+ * symbol. Ends the sequence, performing its result, if it reaches a leaf or
+ * there is no such transition. */
+static void advance_leader(uint8_t symbol, uint32_t time)
+{
+	const uint16_t t = leader.base + symbol;
+	leader.active = false;
+	if (t >= leader_slots)
+		return;
+	const uint32_t dword = pgm_read_dword(&leader_trie->slots[t]);
+	const struct layout_leader_slot slot =
+		*(struct layout_leader_slot*)&dword;
+	if (slot.check != leader.node)
 		return;
+	if (!(slot.base & LEADER_LEAF)) {
+		leader.active = true;
+		leader.node = t;
+		leader.base = slot.base;
+		leader.time = time;
+		return;
+	}
+	const uint32_t result = pgm_read_dword(leader_results +
+			(slot.base & ~LEADER_LEAF));
+	const struct layout_key k = *(struct layout_key*)&result;
+	if (k.scode != 0)
+		tap(press_code(k.scode));
+	actions[k.actions >> 4](leader.key, k.down_arg);
+}
+
+/* Acts on a key event, which does not have to wait for a tap-hold key */
+static void process_event(uint8_t key, bool event, uint32_t time)
+{
+	struct layout_key k = {0};
+	resolve_key(key, &k);
 	if (event == DOWN) {
-		if (layer_cache[key].scode != 0) {
-			state.last_scancode[key] = layer_cache[key].scode;
-			scancode_callback(layer_cache[key].scode, DOWN);
+		/* keys with scancodes make up a leader sequence, the others end
+		 * it and act as usual */
+		if (leader.active) {
+			if (k.scode != 0) {
+				state.momentary[key] = LEADER_CONSUMED;
+				advance_leader(k.scode, time);
+				return;
+			}
+			leader.active = false;
 		}
-		switch (layer_cache[key].actions >> 4) {
-		case REL:
-			load_layer(state.cur_layer +
-					(int8_t)layer_cache[key].down_arg);
-			break;
-		case ABS:
-			load_layer(layer_cache[key].down_arg);
-			break;
-		default:
-			break;
+		/* a one-shot layer applies to the key pressed after it */
+		const uint16_t oneshot = state.oneshot;
+		state.oneshot = 0;
+		const uint8_t type = k.actions >> 4;
+		if (type == HT_KEY || type == HT_LAYER) {
+			/* wait to see whether it is tapped or held */
+			tap_hold.pending = true;
+			tap_hold.key = key;
+			tap_hold.desc = k;
+			tap_hold.time = time;
+			tap_hold.nbuf = 0;
+		} else {
+			if (k.scode != 0) {
+				const uint8_t code = press_code(k.scode);
+				state.last_scancode[key] = code;
+				press(code);
+			}
+			if (type == LEADER)
+				start_leader(key, time);
+			else
+				actions[type](key, k.down_arg);
 		}
+		state.layers &= ~(oneshot & ~state.oneshot);
 	} else {
-		if (layer_cache[key].scode != 0)
-			scancode_callback(state.last_scancode[key], UP);
-		switch (layer_cache[key].actions & 0x0f) {
-		case REL:
-			load_layer(state.cur_layer +
-					(int8_t)layer_cache[key].up_arg);
+		if (state.momentary[key] == LEADER_CONSUMED) {
+			state.momentary[key] = 0;
+			return;
+		}
+		if (state.last_scancode[key] != 0) {
+			release_scancode(state.last_scancode[key]);
+			state.last_scancode[key] = 0;
+		}
+		if (state.momentary[key]) {
+			state.layers &= ~((uint16_t)1 << (state.momentary[key] - 1));
+			state.momentary[key] = 0;
+		}
+		actions[k.actions & 0x0f](key, k.up_arg);
+	}
+}
+
+/* Decides what the pending tap-hold key does and handles the events which
+ * waited for it */
+static void resolve_tap_hold(bool hold)
+{
+	const struct layout_key *k = &tap_hold.desc;
+	tap_hold.pending = false;
+	if (hold) {
+		if (k->actions >> 4 == HT_KEY) {
+			state.last_scancode[tap_hold.key] = k->down_arg;
+			press(k->down_arg);
+		} else {
+			act_mo(tap_hold.key, k->down_arg);
+		}
+	} else if (k->scode != 0) {
+		/* the key has already been released, but the release must not
+		 * reach the host in the same report as the press */
+		tap(press_code(k->scode));
+	}
+	struct held_event buf[TAP_HOLD_BUFFER];
+	const uint8_t n = tap_hold.nbuf;
+	memcpy(buf, tap_hold.buf, n * sizeof(*buf));
+	tap_hold.nbuf = 0;
+	for (uint8_t i = 0; i < n; ++i)
+		handle_event(buf[i].key, buf[i].event, buf[i].time);
+}
+
+/* Tests if a key was pressed while the pending tap-hold key was waiting */
+static bool pressed_while_pending(uint8_t key)
+{
+	for (uint8_t i = 0; i < tap_hold.nbuf; ++i)
+		if (tap_hold.buf[i].key == key && tap_hold.buf[i].event == DOWN)
+			return true;
+	return false;
+}
+
+static void handle_event(uint8_t key, bool event, uint32_t time)
+{
+	if (tap_hold.pending && time - tap_hold.time >= TAP_TICKS)
+		resolve_tap_hold(true);
+	if (!tap_hold.pending) {
+		process_event(key, event, time);
+		return;
+	}
+	if (key == tap_hold.key) {
+		/* released before the timeout */
+		resolve_tap_hold(false);
+		handle_event(key, event, time);
+		return;
+	}
+	const uint8_t policy = tap_hold.desc.up_arg;
+	if ((event == DOWN && (policy & HT_HOLD_ON_OTHER)) ||
+			tap_hold.nbuf == TAP_HOLD_BUFFER) {
+		resolve_tap_hold(true);
+		handle_event(key, event, time);
+		return;
+	}
+	const bool tapped = event == UP && pressed_while_pending(key);
+	tap_hold.buf[tap_hold.nbuf].key = key;
+	tap_hold.buf[tap_hold.nbuf].event = event;
+	tap_hold.buf[tap_hold.nbuf].time = time;
+	++tap_hold.nbuf;
+	/* another key was tapped while this one was held */
+	if (tapped && (policy & HT_PERMISSIVE))
+		resolve_tap_hold(true);
+}
+
+/* Releases the last combo, when the first of its keys is released */
+static void release_combo()
+{
+	const uint32_t dword = pgm_read_dword(&combos[combo.active_combo].desc);
+	const struct layout_key k = *(struct layout_key*)&dword;
+	combo.released = true;
+	/* the combo may have been pressed in this very call */
+	if (k.scode != 0)
+		release_scancode(k.scode);
+	if (state.momentary[combo.owner]) {
+		state.layers &= ~((uint16_t)1 << (state.momentary[combo.owner] - 1));
+		state.momentary[combo.owner] = 0;
+	}
+	actions[k.actions & 0x0f](combo.owner, k.up_arg);
+}
+
+/* Presses a combo instead of the keys held back */
+static void fire_combo(uint8_t i)
+{
+	if (combo.active && !combo.released)
+		release_combo();
+	combo.active = combo.pressed;
+	combo.active_combo = i;
+	combo.owner = combo.held[0].key;
+	combo.released = false;
+	combo.pressed = 0;
+	combo.nheld = 0;
+	const uint32_t dword = pgm_read_dword(&combos[i].desc);
+	const struct layout_key k = *(struct layout_key*)&dword;
+	if (k.scode != 0)
+		press(k.scode);
+	actions[k.actions >> 4](combo.owner, k.down_arg);
+}
+
+/* Finds the combo made of exactly the keys held back, only looking at the
+ * combos which are still possible. more is set if a longer combo is possible.
+ * Returns the number of the combo or -1. */
+static int8_t match_combo(bool *more)
+{
+	int8_t found = -1;
+	*more = false;
+	uint32_t cand = combo.candidates;
+	for (uint8_t i = 0; cand; ++i, cand >>= 1) {
+		if (!(cand & 0x01))
+			continue;
+		if (get_pgm_struct_field(combos + i, mask) == combo.pressed)
+			found = i;
+		else
+			*more = true;
+	}
+	return found;
+}
+
+/* Ends holding keys back, either pressing the combo they make or passing
+ * them on as they are */
+static void end_combo()
+{
+	bool more;
+	const int8_t i = match_combo(&more);
+	if (i >= 0) {
+		fire_combo(i);
+		return;
+	}
+	struct held_event held[COMBO_HELD];
+	const uint8_t n = combo.nheld;
+	memcpy(held, combo.held, n * sizeof(*held));
+	combo.nheld = 0;
+	combo.pressed = 0;
+	for (uint8_t j = 0; j < n; ++j)
+		handle_event(held[j].key, held[j].event, held[j].time);
+}
+
+/* Holds a combo key press back */
+static void hold_combo_key(uint8_t key, uint32_t time, uint8_t bit)
+{
+	combo.pressed |= (uint32_t)1 << bit;
+	combo.candidates &= key_combos[bit];
+	combo.held[combo.nheld].key = key;
+	combo.held[combo.nheld].event = DOWN;
+	combo.held[combo.nheld].time = time;
+	++combo.nheld;
+	/* press the combo as soon as no longer one is possible */
+	bool more;
+	const int8_t i = match_combo(&more);
+	if (i >= 0 && !more)
+		fire_combo(i);
+}
+
+/* Detects combos. Only presses of keys which may still make a combo are held
+ * back, anything else is passed on at once. */
+static void combo_event(uint8_t key, bool event, uint32_t time)
+{
+	if (combo.nheld && time - combo.held[0].time >= COMBO_TICKS)
+		end_combo();
+	const uint8_t b = combo_bit[key];
+	if (!b) {
+		if (combo.nheld)
+			end_combo();
+		handle_event(key, event, time);
+		return;
+	}
+	const uint32_t bit = (uint32_t)1 << (b - 1);
+	if (event == UP && (combo.active & bit)) {
+		combo.active &= ~bit;
+		if (!combo.released)
+			release_combo();
+		return;
+	}
+	if (event == DOWN && !(combo.pressed & bit) &&
+			combo.nheld < COMBO_HELD &&
+			(combo.nheld == 0 ? key_combos[b - 1] :
+				combo.candidates & key_combos[b - 1])) {
+		if (combo.nheld == 0)
+			combo.candidates = ~(uint32_t)0;
+		hold_combo_key(key, time, b - 1);
+		return;
+	}
+	if (combo.nheld) {
+		end_combo();
+		combo_event(key, event, time);
+		return;
+	}
+	handle_event(key, event, time);
+}
+
+/* Sends a key press or key release event to layout */
+void LAYOUT_set_key_state(uint8_t key, bool event, uint32_t time)
+{
+	if (!state.active)
+		return;
+	if (combos)
+		combo_event(key, event, time);
+	else
+		handle_event(key, event, time);
+}
+
+/* Plays the next step of a macro once the previous one has been reported,
+ * so that every step reaches the host in its own report */
+static bool play_macro(uint8_t reports)
+{
+	if (!macro.pos || (macro.waiting && reports == macro.reports))
+		return false;
+	if (macro.tap_code) {
+		scancode_callback(macro.tap_code, UP);
+		macro.tap_code = 0;
+	} else {
+		const uint8_t op = pgm_read_byte(macro.pos);
+		const uint8_t code = pgm_read_byte(macro.pos + 1);
+		macro.pos += 2;
+		switch (op) {
+		case MACRO_DOWN:
+			scancode_callback(code, DOWN);
 			break;
-		case ABS:
-			load_layer(layer_cache[key].up_arg);
+		case MACRO_UP:
+			scancode_callback(code, UP);
 			break;
-		default:
+		case MACRO_TAP:
+			scancode_callback(code, DOWN);
+			macro.tap_code = code;
 			break;
+		default:
+			macro.pos = NULL;
+			return false;
 		}
 	}
+	macro.waiting = true;
+	macro.reports = reports;
+	return true;
+}
+
+bool LAYOUT_poll(uint32_t now, uint8_t reports)
+{
+	if (!state.active)
+		return false;
+	bool changed = false;
+	if (combo.nheld && now - combo.held[0].time >= COMBO_TICKS) {
+		end_combo();
+		changed = true;
+	}
+	changed |= poll_releases(reports);
+	if (tap_hold.pending && now - tap_hold.time >= TAP_TICKS) {
+		resolve_tap_hold(true);
+		changed = true;
+	}
+	if (leader.active && now - leader.time >= LEADER_TICKS) {
+		advance_leader(LEADER_END, now);
+		changed = true;
+	}
+	changed |= play_macro(reports);
+	return changed;
 }
@@ -21,6 +21,54 @@
  * This module provides support for keyboard layouts with layers and layer
  * changing actions.
  *
+ * Apart from the current layer, which the \ref REL and \ref ABS actions
+ * change, any layers can be stacked on top of it with the \ref MO, \ref TG
+ * and \ref OSL actions. A key which has neither a scancode nor actions on a
+ * layer is transparent there, and the topmost active layer on which it is
+ * not transparent decides what it does. The layers defining each key are
+ * kept as a bitmask computed in LAYOUT_set(), so finding that layer is a
+ * single search for the highest set bit.
+ *
+ * A tap-hold key (\ref HT_KEY, \ref HT_LAYER) does something else when it is
+ * tapped and when it is held. Its up action must be \ref NONE, and the up
+ * argument holds the \ref HT_PERMISSIVE and \ref HT_HOLD_ON_OTHER flags. The
+ * key is resolved by the first event which decides it according to these
+ * flags, so typing is not delayed, and only falls back to
+ * \ref LAYOUT_TAP_TIME when no other key is touched. The events which happen
+ * before it is resolved are held back and replayed in order. A scancode
+ * released before its press can have been reported, e.g. a key tapped while
+ * the events were held back, is released by LAYOUT_poll() after the next
+ * report, so it still reaches the host. Other releases are not delayed.
+ *
+ * An extended layout may also define combos (\ref layout_combos). A press of
+ * a key which can start a combo is held back for at most
+ * \ref LAYOUT_COMBO_TIME, and only as long as the keys held back are a part
+ * of some combo, which is a single AND of bitmasks per press. Other keys are
+ * never delayed.
+ *
+ * Macros (\ref layout_macros) are played by LAYOUT_poll() one step per HID
+ * report: a step is played as soon as the report with the previous one has
+ * been sent, so macros go out as fast as the host polls the keyboard, and
+ * no two steps are merged into one report.
+ *
+ * Mod-morph rules (\ref layout_morphs) make a scancode send another one
+ * while some modifiers are pressed, e.g. Esc send the tilde with Shift. A
+ * bitmap of scancodes which have rules is built in LAYOUT_set(), so a
+ * scancode without rules costs a single bit test, and a rule is a single
+ * mask of the modifier byte. Boards which do not load extended layouts can
+ * provide default rules with LAYOUT_set_default_morphs().
+ *
+ * Leader sequences (\ref layout_leader) are stored as a double-array trie in
+ * program space. Every key pressed after a \ref LEADER key advances the
+ * match by one state with a single dword read, so the number of sequences
+ * costs neither RAM nor time per key.
+ *
+ * Two binary formats are supported. A dense layout (\ref layout) stores every
+ * key on every layer. An extended layout (\ref layout_ext) has a table of
+ * sections instead: the base layer is stored densely, and each upper layer
+ * as a run of \ref layout_sparse_key entries sorted by key number, so keys
+ * left out of a run are transparent and take no space.
+ *
  * It is responsible to convert information about key state changes to
  * scancodes which should be sent to the PC. The hardware keys are identified
  * by numbers, as returned by the MATRIX (matrix.h) module.
@@ -49,6 +97,47 @@
 #define REL	0x01
 /*! absolute action */
 #define ABS	0x02
+/*! momentary layer: the layer given as the argument is active while the key
+ * is held (down action only) */
+#define MO	0x03
+/*! toggle the layer given as the argument */
+#define TG	0x04
+/*! one-shot layer: the layer given as the argument is active for the next key
+ * press (down action only) */
+#define OSL	0x05
+/*! tap-hold key: tapping sends the scancode, holding sends the scancode
+ * given as the argument (down action only) */
+#define HT_KEY	0x06
+/*! tap-hold key: tapping sends the scancode, holding activates the layer
+ * given as the argument like \ref MO (down action only) */
+#define HT_LAYER	0x07
+/*! play the macro given as the argument */
+#define MACRO	0x08
+/*! leader key: the keys pressed after it are matched against the sequences
+ * of \ref layout_leader (down action only) */
+#define LEADER	0x09
+/*! number of action types */
+#define NUM_ACTIONS	0x0a
+
+/*! Tap-hold policy flag: a key pressed and released while a tap-hold key is
+ * held makes it held */
+#define HT_PERMISSIVE		(1 << 0)
+/*! Tap-hold policy flag: any key pressed while a tap-hold key is held makes
+ * it held */
+#define HT_HOLD_ON_OTHER	(1 << 1)
+/*! The time (in ms) after which a tap-hold key is held */
+#define LAYOUT_TAP_TIME		200
+
+/*! The maximum number of layers */
+#define LAYOUT_MAX_LAYERS	16
+
+/*! Returned by LAYOUT_set() if the layout is for a different number of keys */
+#define LAYOUT_EKEYS		-1
+/*! Returned by LAYOUT_set() if the layout's structure is malformed */
+#define LAYOUT_EFORMAT		-2
+/*! Returned by LAYOUT_set() if a key has an unknown action or one leading
+ * to a layer which does not exist */
+#define LAYOUT_EACTION		-3
 
 /*! when pressed down */
 #define DOWN	1
@@ -63,8 +152,8 @@ struct layout_key {
 	 * 0 means no scancode */
 	uint8_t scode;
 	/*! Actions to perform on a key.
-	 * Low 4 bits - action type on key-down event.
-	 * High 4 bits - action type on key-up event. */
+	 * High 4 bits - action type on key-down event.
+	 * Low 4 bits - action type on key-up event. */
 	uint8_t actions;
 	/*! Argument to down action */
 	uint8_t down_arg;
@@ -82,6 +171,163 @@ struct layout {
 	struct layout_key data[];
 };
 
+/*! Set in `num_layers` of an extended layout */
+#define LAYOUT_EXTENDED		0x80
+
+/*! Section of an extended layout: the base layer, `num_keys` \ref layout_key
+ * entries */
+#define LAYOUT_SECTION_BASE	0
+/*! Section of an extended layout: a \ref layout_run for each layer above the
+ * base one */
+#define LAYOUT_SECTION_LAYERS	1
+/*! Section of an extended layout: \ref layout_combos */
+#define LAYOUT_SECTION_COMBOS	2
+
+/*! Section of an extended layout: \ref layout_macros */
+#define LAYOUT_SECTION_MACROS	3
+
+/*! Section of an extended layout: \ref layout_morphs */
+#define LAYOUT_SECTION_MORPHS	4
+
+/*! Section of an extended layout: \ref layout_leader */
+#define LAYOUT_SECTION_LEADER	5
+
+/*! Macro step: the end of the macro */
+#define MACRO_END		0x00
+/*! Macro step: press the scancode */
+#define MACRO_DOWN		0x01
+/*! Macro step: release the scancode */
+#define MACRO_UP		0x02
+/*! Macro step: press the scancode, and release it in the next report */
+#define MACRO_TAP		0x03
+/*! The maximum number of steps of a macro */
+#define LAYOUT_MAX_MACRO_STEPS	256
+
+/*! The maximum number of keys which can take part in combos */
+#define LAYOUT_MAX_COMBO_KEYS	32
+/*! The maximum number of combos */
+#define LAYOUT_MAX_COMBOS	32
+/*! The time (in ms) in which all the keys of a combo have to be pressed */
+#define LAYOUT_COMBO_TIME	50
+
+/*! The time (in ms) after the last key of a leader sequence after which the
+ * sequence ends */
+#define LAYOUT_LEADER_TIME	1000
+/*! The symbol of a leader sequence ending with a timeout */
+#define LEADER_END		0x00
+/*! Set in `base` of a trie slot which is a leaf; the low bits are the number
+ * of its result */
+#define LEADER_LEAF		0x8000
+/*! `check` of an unused trie slot */
+#define LEADER_EMPTY		0xffff
+
+/*! The header of an extended layout. All offsets are in bytes from the
+ * beginning of the layout. */
+struct layout_ext {
+	/*! Number of keys */
+	uint8_t num_keys;
+	/*! Number of layers with \ref LAYOUT_EXTENDED set */
+	uint8_t num_layers;
+	/*! Number of entries in `sections` */
+	uint8_t num_sections;
+	uint8_t reserved;
+	/*! Offsets of the sections, `0` for sections which are not present */
+	uint16_t sections[];
+};
+
+/*! The keys defined on an upper layer of an extended layout */
+struct layout_run {
+	/*! Offset of the first \ref layout_sparse_key of the layer */
+	uint16_t offset;
+	/*! Number of keys defined on the layer */
+	uint8_t count;
+	uint8_t reserved;
+};
+
+/*! A key defined on an upper layer of an extended layout */
+struct layout_sparse_key {
+	/*! Key number, the keys of a run are sorted by it */
+	uint8_t key;
+	/*! Description of the key */
+	struct layout_key desc;
+};
+
+/*! The combos of an extended layout: keys pressed together which do
+ * something else than each of them. The section is followed by `num_combos`
+ * \ref layout_combo entries. */
+struct layout_combos {
+	/*! Number of keys which take part in combos */
+	uint8_t num_keys;
+	/*! Number of combos */
+	uint8_t num_combos;
+	/*! The keys which take part in combos; bit `j` of a combo mask stands
+	 * for `keys[j]` */
+	uint8_t keys[];
+};
+
+/*! A single combo */
+struct layout_combo {
+	/*! The keys of the combo, at least two */
+	uint32_t mask;
+	/*! What the combo does; its actions are performed as if by its first
+	 * key, and it is released when any of its keys is released. It cannot
+	 * be a tap-hold key. */
+	struct layout_key desc;
+};
+
+/*! The macros of an extended layout. Every macro is a sequence of two-byte
+ * steps (a \ref MACRO_END, \ref MACRO_DOWN, \ref MACRO_UP or \ref MACRO_TAP
+ * followed by a scancode), ending with \ref MACRO_END. */
+struct layout_macros {
+	/*! Number of macros */
+	uint8_t num_macros;
+	uint8_t reserved;
+	/*! Offsets of the macros */
+	uint16_t offsets[];
+};
+
+/*! The mod-morph rules of an extended layout */
+struct layout_morphs {
+	/*! Number of rules */
+	uint8_t num_morphs;
+	uint8_t reserved;
+	struct layout_morph {
+		/*! The scancode the rule applies to */
+		uint8_t scode;
+		/*! The rule applies if any of these modifiers is pressed (bits
+		 * of the HID modifier byte) */
+		uint8_t mods;
+		/*! The scancode sent instead */
+		uint8_t replacement;
+		uint8_t reserved;
+	} morphs[];
+};
+
+/*! The leader sequences of an extended layout, as a double-array trie. The
+ * symbols are the scancodes of the keys pressed after the leader key, and
+ * \ref LEADER_END when the sequence times out. The transition from the state
+ * in slot `s` on symbol `c` leads to slot `t = slots[s].base + c` if
+ * `slots[t].check == s`. The root is slot `0`, its `check` is
+ * \ref LEADER_EMPTY and its `base` is not `0`. The parent of every other
+ * used slot comes before it. A slot whose `base` has
+ * \ref LEADER_LEAF set ends a sequence. The section is followed by
+ * `num_results` \ref layout_key entries: what the sequences do. A result is
+ * tapped, and its up action must be \ref NONE. */
+struct layout_leader {
+	/*! Number of slots */
+	uint16_t num_slots;
+	/*! Number of results */
+	uint8_t num_results;
+	uint8_t reserved;
+	struct layout_leader_slot {
+		/*! The slot of the parent state, or \ref LEADER_EMPTY */
+		uint16_t check;
+		/*! The base of the transitions from this state, or the result
+		 * with \ref LEADER_LEAF */
+		uint16_t base;
+	} slots[];
+};
+
 /*! A structure which stores the layout's state */
 struct layout_state {
 	/*! Indicates whether the layout generates any actions or keypresses */
@@ -92,6 +338,15 @@ struct layout_state {
 	uint8_t num_layers;
 	/*! Number of currently chosen layer */
 	uint8_t cur_layer;
+	/*! Layers stacked on top of the current one */
+	uint16_t layers;
+	/*! One-shot layers waiting for the next key press */
+	uint16_t oneshot;
+	/*! Bitmask of layers on which each key is not transparent */
+	uint16_t *defined;
+	/*! The momentary layer held by each key plus one, or 0; 0xff for
+	 * keys pressed as a part of a leader sequence */
+	uint8_t *momentary;
 	/*! The last scancode sent by each key.
 	 * This is to make sure a scancode is released even if a key is
 	 * released on a different layer. */
@@ -103,6 +358,8 @@ struct layout_state {
  * \param state the new state of the scancode
  */
 typedef void (*scancode_callback_t)(uint8_t code, bool state);
+/*! Type of function returning the modifier byte of the HID report */
+typedef uint8_t (*modifiers_callback_t)();
 
 /*! Initializes the LAYOUT module. This function should be called before any
  * other function in this module
@@ -110,21 +367,51 @@ typedef void (*scancode_callback_t)(uint8_t code, bool state);
  * \return `0` on success, other value on error
  */
 int LAYOUT_init(int num_keys);
-/*! Sets the layout binary description to be used
+/*! Sets the layout binary description to be used. The whole layout is
+ * checked, and the layout is not used if anything is wrong with it, so
+ * handling key events never has to check it again.
  * \param layout a pointer to program space where the layout description
  * begins
- * \return `0` on success, other value on error
+ * \return `0` on success, \ref LAYOUT_EKEYS, \ref LAYOUT_EFORMAT or
+ * \ref LAYOUT_EACTION on error
  */
 int LAYOUT_set(const struct layout *layout);
 /*! Sets the callback which will be called each time an actual scancode should
  * be changed based on the state of the keys */
 void LAYOUT_set_callback(scancode_callback_t callback);
+/*! Sets the callback used to read the state of the modifiers, which the
+ * mod-morph rules of the layout depend on */
+void LAYOUT_set_modifiers_callback(modifiers_callback_t callback);
+/*! Sets the mod-morph rules used when the layout in use has none, or when
+ * no layout is in use
+ * \param rules a pointer to program space where the rules begin, or NULL
+ * \return `0` on success, \ref LAYOUT_EFORMAT if the rules are malformed,
+ * in which case there are no default rules
+ */
+int LAYOUT_set_default_morphs(const struct layout_morphs *rules);
+/*! Applies the mod-morph rules of the layout to a scancode. The first rule
+ * for the scancode with any of its modifiers in mods applies.
+ * \param code the scancode
+ * \param mods the modifier byte of the HID report
+ * \return the scancode to send instead, or code if no rule applies
+ */
+uint8_t LAYOUT_morph(uint8_t code, uint8_t mods);
 /*! Informs the LAYOUT module of a key's state change
  * \param key key number
  * \param event either \ref UP or \ref DOWN, indicating what happened to the
  * key (equivalent to the new state of the key)
+ * \param time the time of the event in TIMER ticks
+ */
+void LAYOUT_set_key_state(uint8_t key, bool event, uint32_t time);
+/*! Handles the parts of key processing which depend on time passing rather
+ * than on key events. This should be called often, after the key events are
+ * passed to LAYOUT_set_key_state().
+ * \param now the current time in TIMER ticks
+ * \param reports a counter of HID reports sent, used to release scancodes
+ * only after their press has been reported
+ * \return `true` if any scancode changed state
  */
-void LAYOUT_set_key_state(uint8_t key, bool event);
+bool LAYOUT_poll(uint32_t now, uint8_t reports);
 void LAYOUT_deactivate();
 
 /*! @} */
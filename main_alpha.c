@@ -30,7 +30,9 @@
 #include "rawhid_protocol.h"
 #include "dataflash.h"
 #include "layout.h"
+#include "matrix.h"
 #include "hc595.h"
+#include "scheduler.h"
 
 #include <stdio.h> /* sprintf */
 
@@ -58,6 +60,15 @@ volatile uint8_t matrix[19][8] = {
 
 bool states[19][8] = {{0}};
 
+/* Shift+Esc sends the tilde */
+static const struct layout_morphs PROGMEM morphs = {
+	.num_morphs = 1,
+	.morphs = {
+		/* left or right shift in the modifier byte */
+		{.scode = KEY_ESC, .mods = 0x22, .replacement = KEY_TILDE},
+	},
+};
+
 bool is_modifier(uint8_t key_n)
 {
 	static const uint8_t modifiers[] = {41, 52, 53, 54, 55, 57, 58, 59, 60};
@@ -77,38 +88,83 @@ uint16_t get_input()
 	return ret;
 }
 
-void scan_matrix()
+/* row currently driven, or 8 if no scan is in progress */
+static uint8_t scan_row = 8;
+static bool scan_changed, scan_pressed;
+
+/* drives one row low (through the shift register), or none if i >= 8 */
+void drive_row(uint8_t i)
 {
-	bool changed = false;
-	for (uint8_t i = 0; i < 8; ++i) {
-		for (int j = 0; j < 8; ++j)
-			IO_set(j | 0x80, true);
+	for (int j = 0; j < 8; ++j)
+		IO_set(j | 0x80, true);
+	if (i < 8)
 		IO_set((i) | 0x80, false);
-		_delay_us(10);
-		for (uint8_t j = 0; j < 19; ++j) {
-			bool state = !IO_get(j);
-			uint8_t layer = 0;
-			uint8_t code = LAYOUT_get_scancode(layer, matrix[j][i]);
-			if (state != states[j][i]) {
-				changed = true;
-				states[j][i] = state;
-				switch (state) {
-				case true:
-					if (code == KEY_ESC && (HID_scancode_is_pressed(KEY_LEFT_SHIFT) || HID_scancode_is_pressed(KEY_RIGHT_SHIFT)))
-						code = KEY_TILDE;
-					HID_set_scancode_state(code, true);
-					break;
-				case false:
-					if (code == KEY_ESC)
-						HID_set_scancode_state(KEY_TILDE, false);
-					HID_set_scancode_state(code, false);
-					break;
-				}
+}
+
+/* the last rows read from the pins, for MATRIX_deghost() */
+static matrix_row_t raws[8];
+
+/* reads the keys of the currently driven row */
+void scan_matrix_row(uint8_t i)
+{
+	matrix_row_t row = 0;
+	for (uint8_t j = 0; j < 19; ++j)
+		/* there are no keys numbered 0, such positions are empty */
+		if (matrix[j][i] && !IO_get(j))
+			row |= (uint32_t)1 << j;
+	/* there are no diodes */
+	matrix_row_t reported = 0;
+	for (uint8_t j = 0; j < 19; ++j)
+		reported |= (matrix_row_t)states[j][i] << j;
+	row = MATRIX_deghost(raws, 8, i, row, reported);
+	for (uint8_t j = 0; j < 19; ++j) {
+		if (!matrix[j][i])
+			continue;
+		bool state = (row >> j) & 0x01;
+		uint8_t layer = 0;
+		uint8_t code = LAYOUT_get_scancode(layer, matrix[j][i]);
+		scan_pressed |= state;
+		if (state != states[j][i]) {
+			scan_changed = true;
+			states[j][i] = state;
+			switch (state) {
+			case true:
+				code = LAYOUT_morph(code, HID_get_modifiers());
+				HID_set_scancode_state(code, true);
+				break;
+			case false:
+				/* the modifiers may have changed since the
+				 * key was pressed */
+				HID_set_scancode_state(LAYOUT_morph(code, 0xff),
+						false);
+				HID_set_scancode_state(code, false);
+				break;
 			}
 		}
 	}
-	if (changed)
+}
+
+/* performs one step of the matrix scan: reads the row driven in the
+ * previous step and drives the next one, so the row settles between two
+ * interrupts and no interrupt handles more than one row */
+void scan_matrix_step()
+{
+	if (scan_row >= 8) {
+		if (!SCHEDULER_should_scan())
+			return;
+		scan_changed = false;
+		scan_pressed = false;
+		scan_row = 0;
+		drive_row(0);
+		return;
+	}
+	scan_matrix_row(scan_row);
+	drive_row(++scan_row);
+	if (scan_row < 8)
+		return;
+	if (scan_changed)
 		HID_commit_state();
+	SCHEDULER_report(scan_changed || scan_pressed);
 }
 
 int main(void)
@@ -132,6 +188,7 @@ int main(void)
 		;
 
 	HID_commit_state();
+	LAYOUT_set_default_morphs(&morphs);
 
 	int size;
 	DATAFLASH_read_page(1, sizeof(size), &size);
@@ -143,6 +200,9 @@ int main(void)
 	}
 	DATAFLASH_read_page(0, sizeof(matrix), matrix);
 
+	/* scan continuously while typing, every 17 overflows after 1 s of
+	 * quiet; a scan takes 9 overflows */
+	SCHEDULER_init(1, 17, 1000);
 	TCCR0A = 0x00;
 	TCCR0B = 0x03; /* clk_io / 64 */
 	TIMSK0 = _BV(TOIE0);
@@ -161,13 +221,8 @@ void MAIN_handle_sof()
 ISR(TIMER0_OVF_vect)
 {
 	uint8_t prev_endp = USB_get_endpoint();
-	static uint8_t num = 0;
-	if (num > 16) {
-		num = 0;
-		scan_matrix();
-	} else {
-		++num;
-	}
+	SCHEDULER_tick();
+	scan_matrix_step();
 	USB_set_endpoint(prev_endp);
 }
 
@@ -33,29 +33,47 @@
 #include "timer.h"
 #include "leds.h"
 #include "system.h"
+#include "scheduler.h"
+#include "keyqueue.h"
+#include "scanner.h"
+
+#define NO_KEY MATRIX_NO_KEY
 
 uint8_t matrix[5][14] = {
 	{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13},
 	{14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27},
 	{28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41},
 	{42, 43, 44, 45, 46, 47, 48, 49, 50, 51, 52, 53, 54, 55},
-	{56, 57, 58, 0, 0, 59, 0, 0, 0, 64, 60, 61, 62, 63},
+	{56, 57, 58, NO_KEY, NO_KEY, 59, NO_KEY, NO_KEY, NO_KEY, 64, 60, 61,
+		62, 63},
 };
 
 uint8_t rows[] = {0, 1, 2, 3, 4};
 uint8_t cols[] = {5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18};
 
-volatile bool should_scan = false;
+bool matrix_idle = false;
 
-void on_key_press(uint8_t key, bool event)
+void layout_task()
 {
-	if (USB_is_sleeping())
-		USB_wakeup();
-	else
-		LAYOUT_set_key_state(key, event);
+	struct key_event event;
+	bool changed = false;
+	while (KEYQUEUE_pop(&event)) {
+		if (USB_is_sleeping())
+			USB_wakeup();
+		else
+			LAYOUT_set_key_state(event.key, event.state,
+					event.time);
+		changed = true;
+	}
+	changed |= LAYOUT_poll(TIMER_get_ticks(), HID_get_reports_sent());
+	if (changed)
+		HID_commit_state();
 }
 
 bool was_sleeping = false;
+bool was_discovering = false;
+/* scans left until the matrix pins are checked again */
+uint8_t verify_countdown = 0;
 
 void main_task()
 {
@@ -74,13 +92,41 @@ void main_task()
 		}
 		was_sleeping = false;
 	}
-	if (should_scan) {
-		should_scan = false;
+	if (HID_leds_changed())
+		LED_set_indicators(HID_get_leds());
+	if (SCANNER_is_discovering()) {
+		/* the host is finding out the wiring, the pins are not ours */
+		was_discovering = true;
+		return;
+	}
+	if (was_discovering) {
+		if (matrix_idle) {
+			MATRIX_idle_exit();
+			matrix_idle = false;
+		}
+		MATRIX_verify();
+		was_discovering = false;
+	}
+	if (matrix_idle) {
+		/* nothing to scan until the first key press; the other tasks
+		 * only have work after an interrupt, which ends the sleep */
+		if (!MATRIX_idle_poll()) {
+			MATRIX_idle_sleep();
+			return;
+		}
+		MATRIX_idle_exit();
+		matrix_idle = false;
+		SCHEDULER_scan_now();
+	}
+	if (SCHEDULER_should_scan()) {
+		if (verify_countdown-- == 0)
+			MATRIX_verify();
 		bool changed = MATRIX_scan();
-		if (changed)
-			HID_commit_state();
-		if (HID_leds_changed())
-			LED_set_indicators(HID_get_leds());
+		SCHEDULER_report(changed || !MATRIX_is_idle());
+		if (MATRIX_is_idle()) {
+			MATRIX_idle_enter();
+			matrix_idle = true;
+		}
 	}
 }
 
@@ -96,19 +142,27 @@ int main(void)
 	LAYOUT_init(65);
 	LAYOUT_set((struct layout*)LAYOUT_BEGIN);
 	LAYOUT_set_callback(&HID_set_scancode_state);
+	LAYOUT_set_modifiers_callback(&HID_get_modifiers);
 
-	MATRIX_init(5, rows, 14, cols, (const uint8_t*)matrix, &on_key_press);
+	MATRIX_init(5, rows, 14, cols, (const uint8_t*)matrix,
+			MATRIX_DIODES_COL2ROW, &KEYQUEUE_push);
+	MATRIX_set_debounce(5, DEBOUNCE_EAGER_PRESS);
+	/* scan every frame while typing, every 20 frames after 1 s of quiet */
+	SCHEDULER_init(1, 20, 1000);
+	/* scan 250 us before each frame, so that the report leaves in it */
+	SCHEDULER_set_phase(250);
 
 	HID_init();
 	HID_commit_state();
 
 	LED_init();
 
-	SYSTEM_subscribe(USB_SOF, ANY, MAIN_handle_sof);
+	SYSTEM_subscribe(USB_SOF, ANY, SCHEDULER_handle_sof);
 	int sleep_tmr = TIMER_add(32, true);
 	SYSTEM_subscribe(TIMER, sleep_tmr, MAIN_sleep_timer_handler);
 
 	SYSTEM_add_task(main_task, 0);
+	SYSTEM_add_task(layout_task, 0);
 	SYSTEM_add_task(RAWHID_PROTOCOL_task, 0);
 
 	SYSTEM_main_loop();
@@ -118,17 +172,6 @@ void MAIN_sleep_timer_handler()
 {
 	if (!USB_is_sleeping())
 		return;
-	/* make sure to scan the matrix from time to time while asleep */
-	should_scan = true;
-}
-
-void MAIN_handle_sof(void *data)
-{
-	static uint16_t num = 0;
-	if (num > 20) {
-		num = 0;
-		should_scan = true;
-	} else {
-		++num;
-	}
+	/* there are no frames while asleep, so the timer drives the scans */
+	SCHEDULER_tick();
 }
@@ -24,6 +24,7 @@
 #include <stdbool.h>
 
 #include "main.h"
+#include "system.h"
 #include "usb_keyboard.h"
 #include "io.h"
 #include "hid.h"
@@ -31,10 +32,15 @@
 #include "rawhid_protocol.h"
 #include "layout.h"
 #include "matrix.h"
+#include "timer.h"
+#include "scheduler.h"
+#include "keyqueue.h"
+
+#define NO_KEY MATRIX_NO_KEY
 
 uint8_t matrix[4][5] = {
-	{3, 7, 0,  15, 0},
-	{2, 6, 10, 14, 0},
+	{3, 7, NO_KEY, 15, NO_KEY},
+	{2, 6, 10, 14, NO_KEY},
 	{1, 5, 9,  13, 18},
 	{0, 4, 8,  12, 16},
 };
@@ -44,11 +50,13 @@ uint8_t cols[] = {0, 1, 2, 3, 4};
 
 #define LED 9
 
-volatile bool should_scan = false;
-
 int main(void)
 {
 	clock_prescale_set(clock_div_1);
+	/* the report counter and the key timestamps used by LAYOUT_poll()
+	 * come from HID and TIMER, which need the message system */
+	SYSTEM_init();
+	TIMER_init();
 
 	IO_config(LED, OUTPUT);
 	IO_set(LED, true);
@@ -70,25 +78,36 @@ int main(void)
 		}
 	}
 
+	HID_init();
 	HID_commit_state();
 	LAYOUT_set_callback(&HID_set_scancode_state);
+	LAYOUT_set_modifiers_callback(&HID_get_modifiers);
 
-	MATRIX_init(4, rows, 5, cols, (const uint8_t*)matrix, &LAYOUT_set_key_state);
+	MATRIX_init(4, rows, 5, cols, (const uint8_t*)matrix,
+			MATRIX_DIODES_COL2ROW, &KEYQUEUE_push);
+	/* scan continuously while typing, every 17 overflows after 1 s of
+	 * quiet; a scan takes 5 overflows */
+	SCHEDULER_init(1, 17, 1000);
 
 	TCCR0A = 0x00;
 	TCCR0B = 0x03; /* clk_io / 64 */
 	TIMSK0 = _BV(TOIE0);
 	while(1) {
-		if (should_scan) {
-			should_scan = false;
-			bool changed = MATRIX_scan();
-			if (changed)
-				HID_commit_state();
-			/*if (HID_get_leds() & 0x02)
-				IO_set(LED, false);
-			else
-				IO_set(LED, true);*/
+		struct key_event event;
+		bool changed = false;
+		while (KEYQUEUE_pop(&event)) {
+			LAYOUT_set_key_state(event.key, event.state,
+					event.time);
+			changed = true;
 		}
+		changed |= LAYOUT_poll(TIMER_get_ticks(),
+				HID_get_reports_sent());
+		if (changed)
+			HID_commit_state();
+		/*if (HID_get_leds() & 0x02)
+			IO_set(LED, false);
+		else
+			IO_set(LED, true);*/
 		RAWHID_PROTOCOL_task();
 	}
 
@@ -102,11 +121,14 @@ void MAIN_handle_sof()
 
 ISR(TIMER0_OVF_vect)
 {
-	static uint8_t num = 0;
-	if (num > 16) {
-		num = 0;
-		should_scan = true;
-	} else {
-		++num;
-	}
+	static bool scanning = false;
+	SCHEDULER_tick();
+	if (!scanning && !SCHEDULER_should_scan())
+		return;
+	/* one row per interrupt, the row settles until the next one */
+	uint8_t result = MATRIX_scan_step();
+	scanning = !(result & MATRIX_DONE);
+	if (scanning)
+		return;
+	SCHEDULER_report(result & MATRIX_CHANGED || !MATRIX_is_idle());
 }
@@ -29,7 +29,9 @@
 #include "rawhid_protocol.h"
 #include "dataflash.h"
 #include "layout.h"
+#include "matrix.h"
 #include "hc595.h"
+#include "scheduler.h"
 
 uint8_t number_keys[10]=
 	{KEY_0,KEY_1,KEY_2,KEY_3,KEY_4,KEY_5,KEY_6,KEY_7,KEY_8,KEY_9};
@@ -47,6 +49,15 @@ uint8_t matrix[8][8] = {
 
 bool states[8][8] = {{0}};
 
+/* Shift+Esc sends the tilde */
+static const struct layout_morphs PROGMEM morphs = {
+	.num_morphs = 1,
+	.morphs = {
+		/* left or right shift in the modifier byte */
+		{.scode = KEY_ESC, .mods = 0x22, .replacement = KEY_TILDE},
+	},
+};
+
 uint8_t PROGMEM scan_codes[2][61] = {
 	{KEY_ESC,  KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_6, KEY_7, KEY_8, KEY_9, KEY_0, KEY_MINUS, KEY_EQUAL, KEY_BACKSPACE,
 	KEY_TAB, KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_Y, KEY_U, KEY_I, KEY_O, KEY_P, KEY_LEFT_BRACE, KEY_RIGHT_BRACE, KEY_BACKSLASH,
@@ -70,41 +81,72 @@ bool is_modifier(uint8_t key_n)
 	return false;
 }
 
-void scan_matrix()
+/* row currently driven, or 8 if no scan is in progress */
+static uint8_t scan_row = 8;
+static bool scan_changed, scan_pressed;
+
+/* the last rows read from the pins, for MATRIX_deghost() */
+static matrix_row_t raws[8];
+
+/* reads the keys of the currently driven row */
+void scan_matrix_row(uint8_t i)
 {
-	bool changed = false;
-	for (uint8_t i = 0; i < 8; ++i) {
-		PORTD = ~(0x01 << i);
-		_delay_us(10);
-		uint8_t val = PINB;
-		for (uint8_t j = 0; j < 8; ++j) {
-			bool state = !(val & 0x01);
-			uint8_t layer = states[6][7];
-			uint8_t code = LAYOUT_get_scancode(layer, matrix[j][i]);
-			if (state != states[j][i]) {
-				changed = true;
-				states[j][i] = state;
-				switch (state) {
-				case true:
-					if (code == KEY_ESC && (HID_scancode_is_pressed(KEY_LEFT_SHIFT) || HID_scancode_is_pressed(KEY_RIGHT_SHIFT)))
-						code = KEY_TILDE;
-					HID_set_scancode_state(code, true);
-					break;
-				case false:
-					if (code == KEY_ESC)
-						HID_set_scancode_state(KEY_TILDE, false);
-					HID_set_scancode_state(code, false);
-					uint8_t alt_code = LAYOUT_get_scancode(!layer, matrix[j][i]);
-					HID_set_scancode_state(alt_code, false);
-					break;
-				}
+	/* there are no diodes */
+	matrix_row_t reported = 0;
+	for (uint8_t j = 0; j < 8; ++j)
+		reported |= (matrix_row_t)states[j][i] << j;
+	uint8_t val = MATRIX_deghost(raws, 8, i, (uint8_t)~PINB, reported);
+	for (uint8_t j = 0; j < 8; ++j) {
+		bool state = val & 0x01;
+		uint8_t layer = states[6][7];
+		uint8_t code = LAYOUT_get_scancode(layer, matrix[j][i]);
+		scan_pressed |= state;
+		if (state != states[j][i]) {
+			scan_changed = true;
+			states[j][i] = state;
+			switch (state) {
+			case true:
+				code = LAYOUT_morph(code, HID_get_modifiers());
+				HID_set_scancode_state(code, true);
+				break;
+			case false:
+				/* the modifiers may have changed since the
+				 * key was pressed */
+				HID_set_scancode_state(LAYOUT_morph(code, 0xff),
+						false);
+				HID_set_scancode_state(code, false);
+				uint8_t alt_code = LAYOUT_get_scancode(!layer, matrix[j][i]);
+				HID_set_scancode_state(alt_code, false);
+				break;
 			}
-			val >>= 1;
 		}
+		val >>= 1;
+	}
+}
+
+/* performs one step of the matrix scan: reads the row driven in the
+ * previous step and drives the next one, so the row settles between two
+ * interrupts and no interrupt handles more than one row */
+void scan_matrix_step()
+{
+	if (scan_row >= 8) {
+		if (!SCHEDULER_should_scan())
+			return;
+		scan_changed = false;
+		scan_pressed = false;
+		scan_row = 0;
+		PORTD = ~0x01;
+		return;
+	}
+	scan_matrix_row(scan_row);
+	if (++scan_row < 8) {
+		PORTD = ~(0x01 << scan_row);
+		return;
 	}
-	if (changed)
-		HID_commit_state();
 	PORTD = 0xff;
+	if (scan_changed)
+		HID_commit_state();
+	SCHEDULER_report(scan_changed || scan_pressed);
 }
 
 int main(void)
@@ -123,6 +165,7 @@ int main(void)
 		;
 
 	HID_commit_state();
+	LAYOUT_set_default_morphs(&morphs);
 	uint8_t buf[518] = "kupka kupka\n";
 
 	uint8_t *layout = malloc(sizeof(scan_codes));
@@ -130,6 +173,9 @@ int main(void)
 		layout[i] = pgm_read_byte((void*)scan_codes+i);
 	LAYOUT_set(layout);
 
+	/* scan continuously while typing, every 17 overflows after 1 s of
+	 * quiet; a scan takes 9 overflows */
+	SCHEDULER_init(1, 17, 1000);
 	TCCR0A = 0x00;
 	TCCR0B = 0x03; /* clk_io / 64 */
 	TIMSK0 = _BV(TOIE0);
@@ -149,13 +195,8 @@ void MAIN_handle_sof()
 ISR(TIMER0_OVF_vect)
 {
 	uint8_t prev_endp = USB_get_endpoint();
-	static uint8_t num = 0;
-	if (num > 16) {
-		num = 0;
-		scan_matrix();
-	} else {
-		++num;
-	}
+	SCHEDULER_tick();
+	scan_matrix_step();
 	USB_set_endpoint(prev_endp);
 }
 
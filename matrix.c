@@ -20,105 +20,722 @@
  */
 
 #include "matrix.h"
-#include "auxiliary.h"
+#include "platforms.h"
 #include "io.h"
+#include "system.h"
+#include "timer.h"
 
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
 #include <util/delay.h>
+#include <util/delay_basic.h>
 #include <stdlib.h>
 #include <string.h> /* memset */
 
+/* Throughout this file "rows" are the strobed lines and "columns" are the
+ * sensed ones. With MATRIX_STROBE_COLS they are the physical columns and rows
+ * respectively, and the key map is transposed in MATRIX_init(). */
 static const uint8_t *matrix;
-static uint8_t *states;
+/* last known state of every row, one bit per column */
+static matrix_row_t *states;
 static const uint8_t *row_nums;
 static const uint8_t *col_nums;
 static int nrows, ncols;
 static matrix_callback_t callback;
+/* positions of every row which have a key assigned */
+static matrix_row_t *populated;
+/* columns which have a key assigned in any row */
+static matrix_row_t used_cols;
+/* the last rows read from the pins, kept only if there are no diodes */
+static matrix_row_t *raws;
+/* \ref MATRIX_STROBE_ROWS or \ref MATRIX_STROBE_COLS */
+static uint8_t strobe_mode = MATRIX_STROBE_ROWS;
+/* every pin is both a row and a column, see MATRIX_CHARLIEPLEX */
+static bool charlieplex = false;
 
-/*! Retrieves saved state of a key
- * \param row key row number
- * \param col key column number
- * \return `true` if the key is pressed, `false` otherwise
+/*! A single AVR port which some of the column pins belong to */
+struct port_gather {
+	/*! Input register of the port */
+	volatile uint8_t *pinx;
+	/*! Port bits connected to matrix columns */
+	uint8_t mask;
+	/*! Column bit in a packed row for every bit of the port */
+	matrix_row_t cols[8];
+};
+
+static struct port_gather *ports;
+static uint8_t nports;
+/* columns on external pins, which can only be read using IO_get() */
+static matrix_row_t ext_cols;
+
+/*! The data direction and output bits of a row pin */
+struct row_drive {
+	/*! Data direction register of the port, `NULL` for external pins */
+	volatile uint8_t *ddrx;
+	/*! Output register of the port */
+	volatile uint8_t *portx;
+	uint8_t mask;
+};
+
+static struct row_drive *drives;
+
+/*! Number of consecutive correct reads required to accept a settle time */
+#define SETTLE_TRIALS 4
+/* time each row needs to settle after it is driven, in _delay_loop_1() units */
+static uint8_t *settle;
+
+/*! Vertical (bit-sliced) counters of a single row, bit `j` of every field
+ * belongs to the key in column `j` */
+struct debounce_counters {
+	/*! debounced state of the row */
+	matrix_row_t state;
+	/*! 2-bit counter of debounce steps a key has spent in a state different
+	 * from the debounced one */
+	matrix_row_t cnt0, cnt1;
+	/*! 2-bit counter of debounce steps left until a key which changed state
+	 * eagerly may change state eagerly again */
+	matrix_row_t hold0, hold1;
+	/*! keys which differed from their debounced state in the last scan */
+	matrix_row_t pending;
+};
+
+static struct debounce_counters *counters;
+static uint8_t debounce_mode;
+static int8_t debounce_timer = -1;
+/* the period of debounce_timer in TIMER ticks, 0 if debouncing is off; the
+ * timer is stopped in idle mode */
+static uint32_t debounce_period = 0;
+/* number of debounce steps which elapsed since the last scan */
+static volatile uint8_t debounce_steps;
+
+/*! A pin which can wake the microcontroller up using an external interrupt */
+struct wake_int {
+	volatile uint8_t *pinx;
+	uint8_t mask;
+	/*! Number of the external interrupt (INTn) */
+	uint8_t num;
+};
+
+static const struct wake_int wake_ints[] = {
+#if defined(__AVR_ATmega32U4__)
+	{.pinx = &PIND, .mask = _BV(PD0), .num = 0},
+	{.pinx = &PIND, .mask = _BV(PD1), .num = 1},
+	{.pinx = &PIND, .mask = _BV(PD2), .num = 2},
+	{.pinx = &PIND, .mask = _BV(PD3), .num = 3},
+	{.pinx = &PINE, .mask = _BV(PE6), .num = 6},
+#elif defined(__AVR_ATmega32U2__)
+	{.pinx = &PIND, .mask = _BV(PD0), .num = 0},
+	{.pinx = &PIND, .mask = _BV(PD1), .num = 1},
+	{.pinx = &PIND, .mask = _BV(PD2), .num = 2},
+	{.pinx = &PIND, .mask = _BV(PD3), .num = 3},
+	{.pinx = &PINC, .mask = _BV(PC7), .num = 4},
+	{.pinx = &PIND, .mask = _BV(PD4), .num = 5},
+	{.pinx = &PIND, .mask = _BV(PD6), .num = 6},
+	{.pinx = &PIND, .mask = _BV(PD7), .num = 7},
+#endif
+};
+
+/* set by the wake-up interrupts while the matrix is idle */
+static volatile bool idle_woken;
+/* the pin change and external interrupt mask bits armed by arm_wake(), so
+ * that other users of these registers are left alone */
+static uint8_t wake_pcmsk;
+static uint8_t wake_eimsk;
+
+/* Finds the positions of the key map which have keys assigned */
+static void init_populated(uint8_t rows)
+{
+	populated = malloc(rows * sizeof(*populated));
+	used_cols = 0;
+	for (uint8_t i = 0; i < rows; ++i) {
+		populated[i] = 0;
+		for (uint8_t j = 0; j < ncols; ++j)
+			if (matrix[i*ncols + j] != MATRIX_NO_KEY)
+				populated[i] |= (matrix_row_t)1 << j;
+		used_cols |= populated[i];
+	}
+}
+
+/* Builds the gather tables, so that each port is read only once per row.
+ * Columns without keys are left out. */
+static void init_ports()
+{
+	nports = 0;
+	ext_cols = 0;
+	ports = malloc(MATRIX_MAX_PORTS * sizeof(*ports));
+	memset(ports, 0, MATRIX_MAX_PORTS * sizeof(*ports));
+	for (uint8_t j = 0; j < ncols; ++j) {
+		const uint8_t pin = col_nums[j];
+		if (!((used_cols >> j) & 0x01))
+			continue;
+		if (pin & 0x80) {
+			ext_cols |= (matrix_row_t)1 << j;
+			continue;
+		}
+		uint8_t p;
+		for (p = 0; p < nports && ports[p].pinx != PINS[pin].pinx; ++p)
+			;
+		if (p == nports)
+			ports[nports++].pinx = PINS[pin].pinx;
+		ports[p].mask |= PINS[pin].mask;
+		for (uint8_t b = 0; b < 8; ++b)
+			if (PINS[pin].mask & _BV(b))
+				ports[p].cols[b] |= (matrix_row_t)1 << j;
+	}
+	ports = realloc(ports, nports * sizeof(*ports));
+}
+
+/* Looks up the data direction and output bits of every row */
+static void init_drives()
+{
+	drives = malloc(nrows * sizeof(*drives));
+	for (uint8_t i = 0; i < nrows; ++i) {
+		const uint8_t pin = row_nums[i];
+		if (pin & 0x80) {
+			drives[i].ddrx = NULL;
+			drives[i].portx = NULL;
+			drives[i].mask = 0;
+		} else {
+			drives[i].ddrx = PINS[pin].ddrx;
+			drives[i].portx = PINS[pin].portx;
+			drives[i].mask = PINS[pin].mask;
+		}
+	}
+}
+
+/*! Drives a row low or sets it to Hi-Z. This relies on the output register
+ * of the row being 0, which is kept by MATRIX since MATRIX_init(). In a
+ * charlieplexed matrix the row is also a column, so its pull-up is turned off
+ * while it is driven and back on afterwards, never driving it high.
+ * \param i row number
+ * \param on `true` to drive the row low
  */
-bool is_pressed(uint8_t row, uint8_t col)
+static inline void drive_row(uint8_t i, bool on)
 {
-	const uint8_t pos = row*ncols + col;
-	const uint8_t byte = pos / 8;
-	const uint8_t bit = pos & 0x07;
-	return (states[byte] >> bit) & 0x01;
+	if (!drives[i].ddrx) {
+		if (charlieplex && on)
+			IO_set(row_nums[i], false);
+		IO_config(row_nums[i], on ? OUTPUT : INPUT);
+		if (charlieplex && !on)
+			IO_set(row_nums[i], true);
+		return;
+	}
+	if (on) {
+		if (charlieplex)
+			*drives[i].portx &= ~drives[i].mask;
+		*drives[i].ddrx |= drives[i].mask;
+	} else {
+		*drives[i].ddrx &= ~drives[i].mask;
+		if (charlieplex)
+			*drives[i].portx |= drives[i].mask;
+	}
 }
 
-/*! Sets real key state to memory
- * \param row key row number
- * \param col key column number
- * \param state key state
+/* Sets all rows to Hi-Z and all columns to inputs with pull-ups; the
+ * columns come last, so that charlieplexed pins end up with pull-ups */
+static void configure_pins()
+{
+	for (uint8_t i = 0; i < nrows; ++i) {
+		IO_config(row_nums[i], INPUT);
+		IO_set(row_nums[i], false);
+	}
+	for (uint8_t i = 0; i < ncols; ++i) {
+		IO_config(col_nums[i], INPUT);
+		IO_set(col_nums[i], true);
+	}
+}
+
+/*! Reads the state of all columns
+ * \return packed row, with bit `j` set if the key in column `j` is pressed
  */
-void set_state(uint8_t row, uint8_t col, bool state)
+static matrix_row_t read_cols()
 {
-	const uint8_t pos = row*ncols + col;
-	const uint8_t byte = pos / 8;
-	const uint8_t bit = pos & 0x07;
-	if (state)
-		states[byte] |= (1 << bit);
-	else
-		states[byte] &= ~(1 << bit);
+	matrix_row_t row = 0;
+	for (uint8_t p = 0; p < nports; ++p) {
+		/* pressed keys pull the columns down */
+		uint8_t val = ~*ports[p].pinx & ports[p].mask;
+		for (uint8_t b = 0; val; ++b, val >>= 1)
+			if (val & 0x01)
+				row |= ports[p].cols[b];
+	}
+	if (ext_cols) {
+		for (uint8_t j = 0; j < ncols; ++j)
+			if ((ext_cols >> j) & 0x01 && !IO_get(col_nums[j]))
+				row |= (matrix_row_t)1 << j;
+	}
+	return row;
+}
+
+/*! Filters a freshly read row
+ * \param i row number
+ * \param raw packed state of the row as read from the pins
+ * \param steps number of debounce steps elapsed since the last scan
+ * \return debounced state of the row
+ */
+static matrix_row_t debounce(uint8_t i, matrix_row_t raw, uint8_t steps)
+{
+	struct debounce_counters *c = &counters[i];
+	matrix_row_t row = c->state;
+	const matrix_row_t delta = raw ^ row;
+	/* keys which may change state as soon as the change is seen */
+	matrix_row_t eager_dir = 0;
+	if (debounce_mode & DEBOUNCE_EAGER_PRESS)
+		eager_dir |= ~row;
+	if (debounce_mode & DEBOUNCE_EAGER_RELEASE)
+		eager_dir |= row;
+	const matrix_row_t pend = delta & ~eager_dir;
+	/* keys which returned to their debounced state start over */
+	c->cnt0 &= pend;
+	c->cnt1 &= pend;
+	/* only keys which were already pending in the last scan are counted,
+	 * so that a change is always confirmed by a later scan */
+	matrix_row_t counted = pend & c->pending;
+	c->pending = pend;
+	for (; steps; --steps) {
+		/* keys whose counters wrap around to 0 change state */
+		const matrix_row_t done = counted & c->cnt0 & c->cnt1;
+		c->cnt1 ^= c->cnt0 & counted;
+		c->cnt0 ^= counted;
+		row ^= done;
+		counted &= ~done;
+		/* decrement non-zero hold counters */
+		const matrix_row_t hold0 = c->hold0;
+		c->hold0 = ~hold0 & c->hold1;
+		c->hold1 &= hold0;
+	}
+	const matrix_row_t eager = delta & eager_dir & ~(c->hold0 | c->hold1);
+	c->hold0 |= eager;
+	c->hold1 |= eager;
+	return c->state = row ^ eager;
+}
+
+matrix_row_t MATRIX_deghost(matrix_row_t *raws_, uint8_t rows, uint8_t i,
+		matrix_row_t row, matrix_row_t reported)
+{
+	raws_[i] = row;
+	/* a rectangle needs at least two keys in the row */
+	if (!(row & (row - 1)))
+		return row;
+	matrix_row_t ghost = 0;
+	for (uint8_t k = 0; k < rows; ++k) {
+		const matrix_row_t common = row & raws_[k];
+		if (k != i && (common & (common - 1)))
+			ghost |= common;
+	}
+	return (row & ~ghost) | (reported & ghost);
+}
+
+/*! Compares a freshly read row with its saved state and launches callback
+ * for each key which changed state. A change which the callback did not
+ * accept is not saved, so it is reported again in the next scan.
+ * \param i row number
+ * \param row packed state of the row
+ * \param steps number of debounce steps elapsed since the last scan
+ * \return `true` if any key in the row changed state
+ */
+static bool process_row(uint8_t i, matrix_row_t row, uint8_t steps)
+{
+	row &= populated[i];
+	if (raws)
+		row = MATRIX_deghost(raws, nrows, i, row, states[i]);
+	if (debounce_period)
+		row = debounce(i, row, steps);
+	matrix_row_t diff = row ^ states[i];
+	if (!diff)
+		return false;
+	/* the row has just been read */
+	const uint32_t time = TIMER_get_ticks();
+	const uint8_t *keys = matrix + i*ncols;
+	matrix_row_t bit = 1;
+	bool changed = false;
+	for (uint8_t j = 0; diff; ++j, diff >>= 1, bit <<= 1) {
+		if (!(diff & 0x01))
+			continue;
+		if (!callback(keys[j], row & bit, time))
+			continue;
+		states[i] ^= bit;
+		changed = true;
+	}
+	return changed;
+}
+
+/* Pulls all the columns except the driven row down and turns their pull-ups
+ * back on, which is the slowest change the columns have to settle from */
+static void discharge_cols(uint8_t row_pin)
+{
+	for (uint8_t j = 0; j < ncols; ++j) {
+		if (col_nums[j] == row_pin)
+			continue;
+		IO_set(col_nums[j], false);
+		IO_config(col_nums[j], OUTPUT);
+	}
+	for (uint8_t j = 0; j < ncols; ++j) {
+		if (col_nums[j] == row_pin)
+			continue;
+		IO_config(col_nums[j], INPUT);
+		IO_set(col_nums[j], true);
+	}
+}
+
+/* Finds the shortest delay after which every row reads the same as after a
+ * long one */
+static void calibrate()
+{
+	settle = malloc(nrows);
+	for (uint8_t i = 0; i < nrows; ++i) {
+		if (!populated[i])
+			continue;
+		drive_row(i, true);
+		_delay_us(50);
+		const matrix_row_t ref = read_cols();
+		uint8_t n;
+		for (n = 1; n < 255; ++n) {
+			uint8_t ok;
+			for (ok = 0; ok < SETTLE_TRIALS; ++ok) {
+				const uint8_t sreg = SREG;
+				cli();
+				discharge_cols(row_nums[i]);
+				_delay_loop_1(n);
+				const matrix_row_t row = read_cols();
+				SREG = sreg;
+				if (row != ref)
+					break;
+			}
+			if (ok == SETTLE_TRIALS)
+				break;
+		}
+		drive_row(i, false);
+		/* leave some margin for changes of temperature and supply */
+		settle[i] = n < 170 ? n + n/2 : 255;
+	}
+}
+
+/*! Chooses the lines to strobe
+ * \param rows number of rows
+ * \param cols number of columns
+ * \param diodes orientation of the diodes
+ * \return \ref MATRIX_STROBE_ROWS or \ref MATRIX_STROBE_COLS
+ */
+static uint8_t choose_strobe_mode(uint8_t rows, uint8_t cols, uint8_t diodes)
+{
+	if (rows == 0 || diodes == MATRIX_DIODES_COL2ROW ||
+			diodes == MATRIX_CHARLIEPLEX)
+		return MATRIX_STROBE_ROWS;
+	if (diodes == MATRIX_DIODES_ROW2COL)
+		return MATRIX_STROBE_COLS;
+	/* without diodes either way works, so pay for fewer settle delays as
+	 * long as the other lines fit in a packed row */
+	if (cols < rows && rows <= MATRIX_MAX_COLS)
+		return MATRIX_STROBE_COLS;
+	return MATRIX_STROBE_ROWS;
 }
 
 /* if rows == 0, no rows will be multiplexed, but cols inputs will be read as
  * a one-row keyboard matrix */
 void MATRIX_init(uint8_t rows, const uint8_t row_nums_[],
 		uint8_t cols, const uint8_t col_nums_[],
-		const uint8_t *matrix_, matrix_callback_t callback_)
+		const uint8_t *matrix_, uint8_t diodes,
+		matrix_callback_t callback_)
 {
+	strobe_mode = choose_strobe_mode(rows, cols, diodes);
+	charlieplex = diodes == MATRIX_CHARLIEPLEX;
+	if (strobe_mode == MATRIX_STROBE_COLS) {
+		/* strobe-major copy of the key map */
+		uint8_t *keys = malloc(rows * cols);
+		for (uint8_t j = 0; j < cols; ++j)
+			for (uint8_t i = 0; i < rows; ++i)
+				keys[j*rows + i] = matrix_[i*cols + j];
+		matrix = keys;
+		row_nums = col_nums_;
+		col_nums = row_nums_;
+		const uint8_t tmp = rows;
+		rows = cols;
+		cols = tmp;
+	} else {
+		matrix = matrix_;
+		row_nums = row_nums_;
+		col_nums = col_nums_;
+	}
 	nrows = rows;
 	ncols = cols;
 	/* to assert that state array will be created properly for non-matrix
 	 * keyboards... */
 	if (rows == 0)
 		rows = 1;
-	matrix = matrix_;
-	row_nums = row_nums_;
-	col_nums = col_nums_;
-	states = malloc(divceil(rows*cols, 8));
-	memset(states, 0, divceil(rows*cols, 8));
+	states = malloc(rows * sizeof(*states));
+	memset(states, 0, rows * sizeof(*states));
+	counters = malloc(rows * sizeof(*counters));
+	memset(counters, 0, rows * sizeof(*counters));
 	callback = callback_;
+	raws = NULL;
+	if (diodes == MATRIX_DIODES_NONE && nrows > 1) {
+		raws = malloc(rows * sizeof(*raws));
+		memset(raws, 0, rows * sizeof(*raws));
+	}
+	init_populated(rows);
+	init_ports();
+	init_drives();
+	configure_pins();
+	calibrate();
 }
 
-bool MATRIX_scan()
+/*! Checks the configuration of an internal pin
+ * \param pin pin number
+ * \param port expected state of the output register bit
+ * \return `true` if the pin is an input with the expected output register bit,
+ * or an external pin which cannot be checked
+ */
+static bool pin_ok(uint8_t pin, bool port)
 {
-	/* set all rows to Hi-Z */
-	for (uint8_t i = 0; i < nrows; ++i) {
-		IO_config(row_nums[i], INPUT);
-		IO_set(row_nums[i], false);
+	if (pin & 0x80)
+		return true;
+	const struct pin_config *p = &PINS[pin];
+	return !(*p->ddrx & p->mask) && !(*p->portx & p->mask) == !port;
+}
+
+bool MATRIX_verify()
+{
+	bool ok = true;
+	for (uint8_t i = 0; i < nrows; ++i)
+		ok &= pin_ok(row_nums[i], charlieplex);
+	for (uint8_t j = 0; j < ncols; ++j)
+		ok &= pin_ok(col_nums[j], true);
+	if (!ok)
+		configure_pins();
+	return ok;
+}
+
+uint8_t MATRIX_get_mode()
+{
+	return strobe_mode;
+}
+
+static void debounce_timer_handler(void *data)
+{
+	if (*(uint8_t*)data != debounce_timer)
+		return;
+	if (debounce_steps < DEBOUNCE_STEPS)
+		++debounce_steps;
+}
+
+void MATRIX_set_debounce(uint8_t ms, uint8_t mode)
+{
+	static bool subscribed = false;
+	if (debounce_timer >= 0)
+		TIMER_delete(debounce_timer);
+	debounce_timer = -1;
+	debounce_period = 0;
+	debounce_mode = mode;
+	debounce_steps = 0;
+	if (ms == 0)
+		return;
+	uint32_t period = (uint32_t)ms * TIMER_TICKS_PER_MS / DEBOUNCE_STEPS;
+	if (period == 0)
+		period = 1;
+	if (!subscribed) {
+		SYSTEM_subscribe(TIMER, ANY, debounce_timer_handler);
+		subscribed = true;
 	}
-	/* set all columns to input with pull-ups */
-	for (uint8_t i = 0; i < ncols; ++i) {
-		IO_config(col_nums[i], INPUT);
-		IO_set(col_nums[i], true);
+	debounce_timer = TIMER_add(period, true);
+	if (debounce_timer < 0)
+		debounce_timer = -1;
+	else
+		debounce_period = period;
+}
+
+/*! Enables an interrupt which fires when a column pin is pulled down
+ * \param pin column pin number
+ * \return `true` if the pin can wake the microcontroller up
+ */
+static bool arm_wake(uint8_t pin)
+{
+	if (pin & 0x80)
+		return false;
+	/* all pins of port B can trigger pin change interrupt 0 */
+	if (PINS[pin].pinx == &PINB) {
+		wake_pcmsk |= PINS[pin].mask;
+		PCMSK0 |= PINS[pin].mask;
+		return true;
+	}
+	for (uint8_t i = 0; i < sizeof(wake_ints) / sizeof(*wake_ints); ++i) {
+		if (wake_ints[i].pinx != PINS[pin].pinx ||
+				wake_ints[i].mask != PINS[pin].mask)
+			continue;
+		const uint8_t n = wake_ints[i].num;
+		/* trigger on low level, which also works in deep sleep modes */
+		if (n < 4)
+			EICRA &= ~(0x03 << 2*n);
+		else
+			EICRB &= ~(0x03 << 2*(n - 4));
+		EIFR = _BV(n);
+		wake_eimsk |= _BV(n);
+		EIMSK |= _BV(n);
+		return true;
+	}
+	return false;
+}
+
+bool MATRIX_is_idle()
+{
+	/* driving all the pins low would leave nothing to read */
+	if (charlieplex)
+		return false;
+	for (uint8_t i = 0; i < (nrows ? nrows : 1); ++i)
+		if (states[i] || counters[i].state || counters[i].pending)
+			return false;
+	return true;
+}
+
+bool MATRIX_idle_enter()
+{
+	/* nothing is being debounced in idle mode, and the timer would wake
+	 * the microcontroller up every step */
+	if (debounce_timer >= 0) {
+		TIMER_delete(debounce_timer);
+		debounce_timer = -1;
 	}
+	/* all the rows are driven low, so any key pulls its column down */
+	for (uint8_t i = 0; i < nrows; ++i)
+		drive_row(i, true);
+	idle_woken = false;
+	bool all = true;
+	wake_pcmsk = 0;
+	wake_eimsk = 0;
+	for (uint8_t j = 0; j < ncols; ++j)
+		if ((used_cols >> j) & 0x01)
+			all &= arm_wake(col_nums[j]);
+	if (wake_pcmsk) {
+		PCIFR = _BV(PCIF0);
+		PCICR |= _BV(PCIE0);
+	}
+	return all;
+}
+
+bool MATRIX_idle_poll()
+{
+	return idle_woken || read_cols() != 0;
+}
+
+void MATRIX_idle_sleep()
+{
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	/* the instruction following sei is executed before any pending
+	 * interrupt, so a wake-up between the check and the sleep cannot be
+	 * missed */
+	cli();
+	if (!idle_woken) {
+		sleep_enable();
+		sei();
+		sleep_cpu();
+		sleep_disable();
+	}
+	sei();
+}
+
+void MATRIX_idle_exit()
+{
+	PCMSK0 &= ~wake_pcmsk;
+	if (!PCMSK0)
+		PCICR &= ~_BV(PCIE0);
+	EIMSK &= ~wake_eimsk;
+	wake_pcmsk = 0;
+	wake_eimsk = 0;
+	for (uint8_t i = 0; i < nrows; ++i)
+		drive_row(i, false);
+	if (debounce_period && debounce_timer < 0) {
+		debounce_timer = TIMER_add(debounce_period, true);
+		/* plenty of time has passed since the last scan */
+		debounce_steps = DEBOUNCE_STEPS;
+		/* without the timer no step would ever elapse */
+		if (debounce_timer < 0) {
+			debounce_timer = -1;
+			debounce_period = 0;
+		}
+	}
+}
+
+ISR(PCINT0_vect)
+{
+	PCMSK0 &= ~wake_pcmsk;
+	idle_woken = true;
+}
+
+ISR(INT0_vect)
+{
+	/* low level interrupts keep firing while the key is held */
+	EIMSK &= ~wake_eimsk;
+	idle_woken = true;
+}
+ISR(INT1_vect, ISR_ALIASOF(INT0_vect));
+ISR(INT2_vect, ISR_ALIASOF(INT0_vect));
+ISR(INT3_vect, ISR_ALIASOF(INT0_vect));
+ISR(INT6_vect, ISR_ALIASOF(INT0_vect));
+#if defined(__AVR_ATmega32U2__)
+ISR(INT4_vect, ISR_ALIASOF(INT0_vect));
+ISR(INT5_vect, ISR_ALIASOF(INT0_vect));
+ISR(INT7_vect, ISR_ALIASOF(INT0_vect));
+#endif
+
+/* row driven by MATRIX_scan_step(), at least nrows if no scan is in progress */
+static uint8_t step_row = 0xff;
+static uint8_t step_steps;
+static bool step_changed;
+
+/* returns the first row from i on which has any keys, or nrows */
+static uint8_t next_row(uint8_t i)
+{
+	while (i < nrows && !populated[i])
+		++i;
+	return i;
+}
+
+bool MATRIX_scan()
+{
+	step_row = 0xff;
 	bool changed = false;
+	const uint8_t steps = debounce_steps;
+	debounce_steps = 0;
 	/* scan the matrix */
 	for (uint8_t i = 0; i < nrows; ++i) {
-		IO_config(row_nums[i], OUTPUT);
-		_delay_us(1);
-		for (uint8_t j = 0; j < ncols; ++j) {
-			bool state = !IO_get(col_nums[j]);
-			if (state == is_pressed(i, j))
-				continue;
-			changed = true;
-			set_state(i, j, state);
-			callback(matrix[i*ncols + j], state);
-		}
-		IO_config(row_nums[i], INPUT);
+		if (!populated[i])
+			continue;
+		drive_row(i, true);
+		_delay_loop_1(settle[i]);
+		const matrix_row_t row = read_cols();
+		drive_row(i, false);
+		changed |= process_row(i, row, steps);
 	}
-	if (nrows == 0) {
-		for (uint8_t j = 0; j < ncols; ++j) {
-			bool state = !IO_get(col_nums[j]);
-			if (state == is_pressed(0, j))
-				continue;
-			changed = true;
-			set_state(0, j, state);
-			callback(matrix[j], state);
+	if (nrows == 0)
+		changed |= process_row(0, read_cols(), steps);
+	return changed;
+}
+
+uint8_t MATRIX_scan_step()
+{
+	if (step_row >= nrows) {
+		/* start a new scan */
+		step_steps = debounce_steps;
+		debounce_steps = 0;
+		step_changed = false;
+		if (nrows == 0) {
+			if (process_row(0, read_cols(), step_steps))
+				return MATRIX_DONE | MATRIX_CHANGED;
+			return MATRIX_DONE;
 		}
+		step_row = next_row(0);
+		if (step_row >= nrows)
+			return MATRIX_DONE;
+		drive_row(step_row, true);
+		return 0;
 	}
-	return changed;
+	/* the row has been settling since the previous step */
+	const matrix_row_t row = read_cols();
+	drive_row(step_row, false);
+	step_changed |= process_row(step_row, row, step_steps);
+	step_row = next_row(step_row + 1);
+	if (step_row < nrows) {
+		drive_row(step_row, true);
+		return step_changed ? MATRIX_CHANGED : 0;
+	}
+	return step_changed ? MATRIX_DONE | MATRIX_CHANGED : MATRIX_DONE;
 }
@@ -22,10 +22,31 @@
  *
  * This module implements matrix keyboard support. It scans a matrix by
  * setting one of the row pins to 0 at a time and reading the column
- * pins. The pins are properly configured each time the matrix is scanned, but
- * their configuration is not restored afterwards. The ouput of the row
- * currently scanned is set to 0, while the outputs of other rows are set to
- * Hi-Z.
+ * pins. If the diodes point from the rows to the columns, or there are no
+ * diodes and there are fewer columns than rows, the columns are strobed and
+ * the rows read instead, which is transparent to the rest of the firmware.
+ * In the description below rows and columns are the strobed and read lines
+ * respectively. Every port the column pins are connected to is read only once per
+ * row, and the result is turned into a packed row (\ref matrix_row_t) using
+ * gather tables computed in MATRIX_init(). The state of the matrix is stored
+ * as one packed word per row, so finding the keys which changed state is a
+ * single comparison for every row in which nothing happened.
+ *
+ * The pins are configured once in MATRIX_init(): the rows are Hi-Z inputs
+ * with their output registers set to 0 and the columns are inputs with
+ * pull-ups. Scanning a row only sets its data direction bit, which drives it
+ * low, and clears it afterwards. Code sharing the ports with the matrix must
+ * keep this configuration, and MATRIX_verify() can be used to detect and
+ * repair any drift. MATRIX_init() also measures how long every row takes to
+ * settle after it is driven, by discharging the columns and checking how
+ * soon they read the same as after a long delay, and MATRIX_scan() waits only
+ * that long for each row.
+ *
+ * When no key is pressed, the matrix can be put in idle mode with
+ * MATRIX_idle_enter(). All the rows are then driven low and the column pins
+ * are armed as pin change or external interrupts, so the first key press is
+ * noticed without scanning, and the microcontroller can sleep with
+ * MATRIX_idle_sleep() until it happens.
  *
  * It is also possible to read the state of a number of keys connected to
  * microcontroller's pins, without the concept of a matrix. In order to
@@ -34,7 +55,8 @@
  * The keys are identified by numbers as an extra level of indirection, so a
  * mapping between matrix coordinates and key numbers has to be provided. This
  * way after a change in the matrix layout or even rearrangement of the keys
- * it is enough to change the mapping array.
+ * it is enough to change the mapping array. Positions without a key are
+ * marked with \ref MATRIX_NO_KEY.
  *
  * @{
  */
@@ -44,12 +66,65 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+/*! The maximum number of columns in a matrix */
+#define MATRIX_MAX_COLS 32
+/*! The maximum number of distinct AVR ports the columns can be connected to */
+#define MATRIX_MAX_PORTS 6
+
+/*! A packed state of a single matrix row, one bit per column */
+typedef uint32_t matrix_row_t;
+
+/*! A key number marking a position of the key map without a key */
+#define MATRIX_NO_KEY		0xff
+
+/*! Returned by MATRIX_scan_step() when a whole scan has been completed */
+#define MATRIX_DONE		(1 << 0)
+/*! Returned by MATRIX_scan_step() when a key changed state during the
+ * current scan */
+#define MATRIX_CHANGED		(1 << 1)
+
+/*! Diode orientation: current flows from the columns to the rows, so the rows
+ * have to be strobed */
+#define MATRIX_DIODES_COL2ROW	0
+/*! Diode orientation: current flows from the rows to the columns, so the
+ * columns have to be strobed */
+#define MATRIX_DIODES_ROW2COL	1
+/*! There are no diodes, so either the rows or the columns can be strobed.
+ * Keys which form a rectangle with other pressed keys cannot be told from
+ * ghosts, so they keep their state until the rectangle is broken (see
+ * MATRIX_deghost()). */
+#define MATRIX_DIODES_NONE	2
+/*! Charlieplexed or duplex wiring: every pin is both strobed and read. The
+ * same pins must be given as rows and columns, and `matrix[cols*i + j]` is
+ * the key which pulls pin `j` down while pin `i` is driven, so the diagonal
+ * must be \ref MATRIX_NO_KEY. A duplex matrix is the special case with two
+ * groups of pins and keys only between the groups. The matrix cannot enter
+ * idle mode. */
+#define MATRIX_CHARLIEPLEX	3
+
+/*! Returned by MATRIX_get_mode() when the rows are strobed */
+#define MATRIX_STROBE_ROWS	0
+/*! Returned by MATRIX_get_mode() when the columns are strobed */
+#define MATRIX_STROBE_COLS	1
+
+/*! Debounce mode flag: report a press as soon as it is seen */
+#define DEBOUNCE_EAGER_PRESS	(1 << 0)
+/*! Debounce mode flag: report a release as soon as it is seen */
+#define DEBOUNCE_EAGER_RELEASE	(1 << 1)
+/*! Number of steps the debounce time is divided into */
+#define DEBOUNCE_STEPS		4
+
 /*! A function of this type is called each time the key matrix changes state
  *
  * \param key_num the number of the key which changed state
  * \param state the current state of the key
+ * \param time the time (in TIMER ticks, see TIMER_get_ticks()) at which the
+ * row was read in the scan which detected the change; with deferred
+ * debouncing this is the end of the debounce time, not the first edge
+ * \return `true` if the change was accepted; `false` if it could not be
+ * handled now, in which case it is reported again in the next scan
  */
-typedef void (*matrix_callback_t)(uint8_t key_num, bool state);
+typedef bool (*matrix_callback_t)(uint8_t key_num, bool state, uint32_t time);
 
 /*! Initializes the MATRIX module. This function must be called before any
  * other function in this module.
@@ -58,20 +133,107 @@ typedef void (*matrix_callback_t)(uint8_t key_num, bool state);
  * accepted which means there are no rows to control - in this case one row is
  * assumed, and there is no multiplexing
  * \param row_nums_ an array of size `rows` of output pins for each row
- * \param cols number of columns in the matrix
+ * \param cols number of columns in the matrix (at most \ref MATRIX_MAX_COLS)
  * \param col_nums_ an array of size cols of input pins for each column
  * \param matrix an array of size `rows*cols` representing the mapping between
  * physical keys and their numbers, stored in row-major order, such that
  * `matrix[cols*i + j]` contains the number assigned to the key in row `i` and
- * column `j`
+ * column `j`, or \ref MATRIX_NO_KEY if there is no key there; empty positions
+ * are never reported, and rows and columns without keys are not scanned
+ * \param diodes orientation of the diodes, one of \ref MATRIX_DIODES_COL2ROW,
+ * \ref MATRIX_DIODES_ROW2COL and \ref MATRIX_DIODES_NONE, or
+ * \ref MATRIX_CHARLIEPLEX; the lines which are read must fit in a packed row
  * \param callback_ the function to be called when a key changes state
  */
 void MATRIX_init(uint8_t rows, const uint8_t row_nums_[],
 		uint8_t cols, const uint8_t col_nums_[],
-		const uint8_t *matrix_, matrix_callback_t callback_);
+		const uint8_t *matrix_, uint8_t diodes,
+		matrix_callback_t callback_);
+/*! Tells which lines are strobed. The mode is chosen in MATRIX_init() so that
+ * as few lines as possible are strobed, and thus as few settle delays are
+ * paid per scan, which the diodes allow.
+ * \return \ref MATRIX_STROBE_ROWS or \ref MATRIX_STROBE_COLS
+ */
+uint8_t MATRIX_get_mode();
+
+/*! Configures debouncing of the keys.
+ *
+ * The debounce time is divided into \ref DEBOUNCE_STEPS steps measured with
+ * the TIMER module and each row is debounced at once using vertical counters.
+ * A deferred change of state is reported after the key has been seen in the
+ * new state for the whole debounce time. An eager change is reported in the
+ * scan which sees it first, and further eager changes of the same key are
+ * ignored for the debounce time. This function must be called after
+ * MATRIX_init().
+ *
+ * \param ms debounce time in milliseconds; `0` disables debouncing
+ * \param mode a combination of \ref DEBOUNCE_EAGER_PRESS and
+ * \ref DEBOUNCE_EAGER_RELEASE; changes without their flag are deferred
+ */
+void MATRIX_set_debounce(uint8_t ms, uint8_t mode);
+
+/*! Checks that the matrix pins are still configured as set up by
+ * MATRIX_init() and configures them again if they are not. Only the pins of
+ * the microcontroller can be checked. This must not be called in idle mode or
+ * while a time-sliced scan is in progress.
+ * \return `true` if the configuration was correct
+ */
+bool MATRIX_verify();
+
+/*! Tests if all keys are released and none of them is being debounced
+ * \return `true` if the matrix can be put in idle mode
+ */
+bool MATRIX_is_idle();
+/*! Puts the matrix in idle mode. MATRIX_scan() must not be called until
+ * MATRIX_idle_exit() is called.
+ * \return `true` if every column pin can wake the microcontroller up with an
+ * interrupt; `false` if some of them can only be checked with
+ * MATRIX_idle_poll()
+ */
+bool MATRIX_idle_enter();
+/*! Checks if a key was pressed since the matrix entered idle mode. This reads
+ * each port the columns are connected to once.
+ * \return `true` if a key was pressed
+ */
+bool MATRIX_idle_poll();
+/*! Puts the microcontroller to sleep (idle sleep mode, so USB and the timers
+ * keep running) until the next interrupt, unless a wake-up interrupt has
+ * already fired. MATRIX_idle_poll() should be called after it returns, as
+ * columns which cannot wake the microcontroller up are only checked then,
+ * after some other interrupt such as a USB start of frame.
+ */
+void MATRIX_idle_sleep();
+/*! Leaves idle mode, so that the matrix can be scanned again */
+void MATRIX_idle_exit();
+
+/*! Holds the keys of a row which form a rectangle with another row. Without
+ * diodes three keys pressed in the corners of a rectangle make the fourth
+ * one look pressed, so no change of those keys can be trusted. The other rows
+ * are compared as last read, so this costs no extra scanning. MATRIX_scan()
+ * does this itself for \ref MATRIX_DIODES_NONE; boards which scan their
+ * matrix on their own can call it for every row they read.
+ * \param raws the last rows read from the pins, updated with `row`
+ * \param rows number of rows in `raws`
+ * \param i row number
+ * \param row packed state of the row as read from the pins
+ * \param reported packed state of the row as last reported
+ * \return the row with the ambiguous keys in their last reported state
+ */
+matrix_row_t MATRIX_deghost(matrix_row_t *raws, uint8_t rows, uint8_t i,
+		matrix_row_t row, matrix_row_t reported);
 
 /*! Performs a single matrix scan and launches callback for each key which
  * changed state since the last scan */
 bool MATRIX_scan();
+/*! Performs one step of a time-sliced scan. The first step of a scan drives
+ * the first row, and every following step reads the row driven by the
+ * previous one, launches callbacks for its keys and drives the next row, so
+ * the rows settle between the steps while other work runs. A scan of `rows`
+ * rows takes `rows + 1` steps and each step handles at most one row, which
+ * makes it suitable for calling from an interrupt handler. Steps and
+ * MATRIX_scan() must not be mixed in a single scan.
+ * \return a combination of \ref MATRIX_DONE and \ref MATRIX_CHANGED
+ */
+uint8_t MATRIX_scan_step();
 
 /*! @} */
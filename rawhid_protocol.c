@@ -21,6 +21,8 @@
 #include "crc.h"
 #include "auxiliary.h"
 #include "main.h"
+#include "scanner.h"
+#include "timer.h"
 
 #include <avr/interrupt.h>
 #include <stdlib.h>
@@ -76,14 +78,94 @@
  *                                               data (128 bytes)
  *  0x02 activate layout                         none
  *  0x03 deactivate layout                       none
+ *  0x04 start wiring discovery                  pins to test (optional,
+ *                                               all but the LED pins if
+ *                                               none are given)
+ *  0x05 stop wiring discovery                   none
  *
  *  Device to Host:
+ *  type description                             arguments
+ *  0x80 key found during discovery              key number, driven pin, read
+ *                                               pin, 1 if no diode (1 byte
+ *                                               each)
+ *  0x81 matrix found during discovery           number of rows, number of
+ *                                               columns (1 byte each), row
+ *                                               pins, column pins, key
+ *                                               numbers in row-major order
+ *                                               (0xff for no key)
  */
 
 static volatile struct RAWHID_state state;
 
+/* number of keys found in discovery mode already sent to the host */
+static uint8_t keys_sent;
+
+/* how long to wait for the host to take a packet */
+#define SEND_TIMEOUT (100 * TIMER_TICKS_PER_MS)
+
+/* sends a packet, waiting until the host takes it or SEND_TIMEOUT passes */
+static bool send_packet(const struct RAWHID_packet *buf)
+{
+	const uint32_t start = TIMER_get_ticks();
+	while (!RAWHID_send(buf))
+		if (TIMER_get_ticks() - start > SEND_TIMEOUT)
+			return false;
+	return true;
+}
+
+/* sends a message to the host */
+static bool send_message(uint8_t len, const uint8_t *msg)
+{
+	struct RAWHID_packet buf;
+	buf.header = MSG_START;
+	buf.payload[0] = len;
+	const uint16_t crc = crc16(len, msg);
+	memcpy(&buf.payload[1], &crc, sizeof(crc));
+	int sent = min(RAWHID_SIZE - MSG_HDR_SIZE - 1, len);
+	memcpy(buf.payload + MSG_HDR_SIZE, msg, sent);
+	if (!send_packet(&buf))
+		return false;
+	buf.header = MSG_CONT;
+	while (sent < len) {
+		const int to_copy = min(RAWHID_SIZE - 1, len - sent);
+		memcpy(buf.payload, msg + sent, to_copy);
+		if (!send_packet(&buf))
+			return false;
+		sent += to_copy;
+	}
+	return true;
+}
+
+/* sends the keys found since the last call */
+static void discovery_task()
+{
+	const uint8_t nkeys = SCANNER_discover_step();
+	while (keys_sent < nkeys) {
+		const struct scan_result *key = SCANNER_get_key(keys_sent);
+		const uint8_t msg[] = {MESSAGE_KEY_FOUND, keys_sent, key->a,
+			key->b, key->status == SCAN_OK_BI};
+		if (!send_message(sizeof(msg), msg))
+			return;
+		++keys_sent;
+	}
+}
+
+static void stop_discovery()
+{
+	uint8_t *msg = malloc(255);
+	const uint8_t len = SCANNER_get_matrix(msg + 1, 254);
+	SCANNER_discover_stop();
+	if (len) {
+		msg[0] = MESSAGE_MATRIX;
+		send_message(len + 1, msg);
+	}
+	free(msg);
+}
+
 void RAWHID_PROTOCOL_task()
 {
+	if (SCANNER_is_discovering())
+		discovery_task();
 	if (state.status != EXECUTING)
 		return;
 	uint8_t hdr = state.msg[0];
@@ -98,6 +180,9 @@ void RAWHID_PROTOCOL_task()
 		}
 		const uint8_t pageno = state.msg[1];
 		uint32_t addr = LAYOUT_BEGIN + pageno*SPM_PAGESIZE;
+		/* the layout is only checked when activated, so it must not
+		 * be used while it is being rewritten */
+		LAYOUT_deactivate();
 		flash_write_page(addr, (uint8_t*)state.msg + 2);
 		break;
 	case MESSAGE_ACTIVATE_LAYOUT:
@@ -105,7 +190,10 @@ void RAWHID_PROTOCOL_task()
 			state.status = MESSAGE_ERROR;
 			return;
 		}
-		LAYOUT_set((const struct layout*)LAYOUT_BEGIN);
+		if (LAYOUT_set((const struct layout*)LAYOUT_BEGIN)) {
+			state.status = LAYOUT_ERROR;
+			return;
+		}
 		break;
 	case MESSAGE_DEACTIVATE_LAYOUT:
 		if (state.len != 1) {
@@ -114,6 +202,21 @@ void RAWHID_PROTOCOL_task()
 		}
 		LAYOUT_deactivate();
 		break;
+	case MESSAGE_START_DISCOVERY:
+		if (!SCANNER_discover_start(state.len - 1,
+					(const uint8_t*)state.msg + 1)) {
+			state.status = MESSAGE_ERROR;
+			return;
+		}
+		keys_sent = 0;
+		break;
+	case MESSAGE_STOP_DISCOVERY:
+		if (state.len != 1 || !SCANNER_is_discovering()) {
+			state.status = MESSAGE_ERROR;
+			return;
+		}
+		stop_discovery();
+		break;
 	default:
 		state.status = WRONG_MESSAGE_ERROR;
 		return;
@@ -31,6 +31,11 @@
 #define MESSAGE_WRITE_PAGE		0x01
 #define MESSAGE_ACTIVATE_LAYOUT		0x02
 #define MESSAGE_DEACTIVATE_LAYOUT	0x03
+#define MESSAGE_START_DISCOVERY		0x04
+#define MESSAGE_STOP_DISCOVERY		0x05
+/* Device to host */
+#define MESSAGE_KEY_FOUND		0x80
+#define MESSAGE_MATRIX			0x81
 
 #define MSG_HDR_SIZE		3
 
@@ -43,6 +48,7 @@
 #define MESSAGE_ERROR		6
 #define BUSY_ERROR		7
 #define WRONG_MESSAGE_ERROR	8
+#define LAYOUT_ERROR		9
 
 struct RAWHID_packet {
 	uint8_t header;
@@ -17,6 +17,12 @@
 
 #include "scanner.h"
 #include "io.h"
+#include "matrix.h"
+#include "platforms.h"
+
+#include <util/delay.h>
+#include <stdlib.h>
+#include <string.h>
 
 struct scan_result SCANNER_scan(uint8_t noutputs, uint8_t outputs[],
 		uint8_t ninputs, uint8_t inputs[])
@@ -52,3 +58,209 @@ struct scan_result SCANNER_scan(uint8_t noutputs, uint8_t outputs[],
 	}
 	return result;
 }
+
+static uint8_t *disc_pins = NULL;
+static uint8_t disc_npins;
+/* bit j of seen[i] is set if driving pin i pulled pin j down */
+static uint32_t *seen;
+static struct scan_result *keys;
+static uint8_t nkeys;
+
+/* tests if a pin drives an indicator LED, which TIMER0 keeps toggling */
+static bool is_led_pin(uint8_t pin)
+{
+	for (uint8_t i = 0; i < NUM_LEDS; ++i)
+		if (leds[i].pin == pin)
+			return true;
+	return false;
+}
+
+bool SCANNER_discover_start(uint8_t npins, const uint8_t pins[])
+{
+	if (disc_pins || npins > SCANNER_MAX_PINS)
+		return false;
+	/* external pins are not numbered below NUM_IO either */
+	for (uint8_t i = 0; i < npins; ++i)
+		if (pins[i] >= NUM_IO || is_led_pin(pins[i]))
+			return false;
+	if (npins == 0) {
+		disc_pins = malloc(NUM_IO);
+		for (uint8_t pin = 0; pin < NUM_IO; ++pin)
+			if (!is_led_pin(pin))
+				disc_pins[npins++] = pin;
+		if (npins > SCANNER_MAX_PINS) {
+			free(disc_pins);
+			disc_pins = NULL;
+			return false;
+		}
+	} else {
+		disc_pins = malloc(npins);
+		memcpy(disc_pins, pins, npins);
+	}
+	disc_npins = npins;
+	seen = malloc(npins * sizeof(*seen));
+	memset(seen, 0, npins * sizeof(*seen));
+	keys = malloc(SCANNER_MAX_KEYS * sizeof(*keys));
+	nkeys = 0;
+	for (int i = 0; i < npins; ++i) {
+		IO_config(disc_pins[i], INPUT);
+		IO_set(disc_pins[i], true); /* pull-up */
+	}
+	return true;
+}
+
+/* records that driving pin i pulls pin j down */
+static void discover_pair(uint8_t i, uint8_t j)
+{
+	if ((seen[i] >> j) & 0x01)
+		return;
+	seen[i] |= (uint32_t)1 << j;
+	if ((seen[j] >> i) & 0x01) {
+		/* the same key seen the other way */
+		for (uint8_t k = 0; k < nkeys; ++k)
+			if (keys[k].a == disc_pins[j] && keys[k].b == disc_pins[i])
+				keys[k].status = SCAN_OK_BI;
+		return;
+	}
+	if (nkeys == SCANNER_MAX_KEYS)
+		return;
+	keys[nkeys].status = SCAN_OK_UNI;
+	keys[nkeys].a = disc_pins[i];
+	keys[nkeys].b = disc_pins[j];
+	++nkeys;
+}
+
+uint8_t SCANNER_discover_step()
+{
+	if (!disc_pins)
+		return 0;
+	for (uint8_t i = 0; i < disc_npins; ++i) {
+		IO_set(disc_pins[i], false);
+		IO_config(disc_pins[i], OUTPUT);
+		_delay_us(10);
+		for (uint8_t j = 0; j < disc_npins; ++j)
+			if (j != i && !IO_get(disc_pins[j]))
+				discover_pair(i, j);
+		IO_config(disc_pins[i], INPUT);
+		IO_set(disc_pins[i], true);
+	}
+	return nkeys;
+}
+
+const struct scan_result *SCANNER_get_key(uint8_t n)
+{
+	return &keys[n];
+}
+
+/* adds pin to the set, returns its index */
+static uint8_t add_pin(uint8_t *set, uint8_t *n, uint8_t pin)
+{
+	uint8_t i;
+	for (i = 0; i < *n && set[i] != pin; ++i)
+		;
+	if (i == *n)
+		set[(*n)++] = pin;
+	return i;
+}
+
+#define SIDE_NONE	0
+#define SIDE_ROW	1
+#define SIDE_COL	2
+
+/* puts a pin on a side of the matrix, returns false if it is on the other */
+static bool set_side(uint8_t *side, uint8_t pin, uint8_t s)
+{
+	if (side[pin] != SIDE_NONE && side[pin] != s)
+		return false;
+	side[pin] = s;
+	return true;
+}
+
+/* Splits the pins of the keys found into rows and columns. The driven pin of
+ * a key with a diode is a row. A key without one only needs its pins to be
+ * on different sides, so the sides are spread from the pins it shares with
+ * other keys, and a group of such keys sharing no pin with the rest starts
+ * with its first pin as a row. Returns false if some pin would have to be
+ * both a row and a column. */
+static bool classify_pins(uint8_t *side)
+{
+	memset(side, SIDE_NONE, NUM_IO);
+	for (uint8_t k = 0; k < nkeys; ++k)
+		if (keys[k].status == SCAN_OK_UNI &&
+				(!set_side(side, keys[k].a, SIDE_ROW) ||
+				 !set_side(side, keys[k].b, SIDE_COL)))
+			return false;
+	for (;;) {
+		bool changed;
+		do {
+			changed = false;
+			for (uint8_t k = 0; k < nkeys; ++k) {
+				if (keys[k].status != SCAN_OK_BI)
+					continue;
+				const uint8_t a = keys[k].a, b = keys[k].b;
+				if (side[a] == SIDE_NONE && side[b] == SIDE_NONE)
+					continue;
+				if (side[a] == side[b])
+					return false;
+				if (side[a] == SIDE_NONE || side[b] == SIDE_NONE) {
+					side[a] = SIDE_ROW + SIDE_COL - side[b];
+					side[b] = SIDE_ROW + SIDE_COL - side[a];
+					changed = true;
+				}
+			}
+		} while (changed);
+		uint8_t k;
+		for (k = 0; k < nkeys; ++k)
+			if (side[keys[k].a] == SIDE_NONE)
+				break;
+		if (k == nkeys)
+			return true;
+		side[keys[k].a] = SIDE_ROW;
+	}
+}
+
+uint8_t SCANNER_get_matrix(uint8_t *buf, uint8_t size)
+{
+	uint8_t side[NUM_IO];
+	if (!classify_pins(side))
+		return 0;
+	uint8_t rows[SCANNER_MAX_PINS], cols[SCANNER_MAX_PINS];
+	uint8_t nrows = 0, ncols = 0;
+	for (uint8_t k = 0; k < nkeys; ++k) {
+		const bool swap = side[keys[k].a] == SIDE_COL;
+		add_pin(rows, &nrows, swap ? keys[k].b : keys[k].a);
+		add_pin(cols, &ncols, swap ? keys[k].a : keys[k].b);
+	}
+	const uint16_t len = 2 + nrows + ncols + nrows*ncols;
+	if (len > size)
+		return 0;
+	buf[0] = nrows;
+	buf[1] = ncols;
+	memcpy(buf + 2, rows, nrows);
+	memcpy(buf + 2 + nrows, cols, ncols);
+	uint8_t *matrix = buf + 2 + nrows + ncols;
+	memset(matrix, MATRIX_NO_KEY, nrows*ncols);
+	for (uint8_t k = 0; k < nkeys; ++k) {
+		const bool swap = side[keys[k].a] == SIDE_COL;
+		const uint8_t i = add_pin(rows, &nrows,
+				swap ? keys[k].b : keys[k].a);
+		const uint8_t j = add_pin(cols, &ncols,
+				swap ? keys[k].a : keys[k].b);
+		matrix[i*ncols + j] = k;
+	}
+	return len;
+}
+
+void SCANNER_discover_stop()
+{
+	free(keys);
+	free(seen);
+	free(disc_pins);
+	disc_pins = NULL;
+	nkeys = 0;
+}
+
+bool SCANNER_is_discovering()
+{
+	return disc_pins != NULL;
+}
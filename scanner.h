@@ -32,3 +32,32 @@ struct scan_result {
 
 struct scan_result SCANNER_scan(uint8_t noutputs, uint8_t outputs[],
 		uint8_t ninputs, uint8_t inputs[]);
+
+/* the maximum number of pins discovery can be run on */
+#define SCANNER_MAX_PINS	32
+/* the maximum number of keys discovery can find */
+#define SCANNER_MAX_KEYS	128
+
+/* Starts discovering the wiring of a keyboard: every pin in pins[] is driven
+ * in turn and every other one is read, so each key the user presses closes a
+ * pin pair which is recorded once. The pins are left as inputs with pull-ups.
+ * All the pins except the LED ones are used if npins is 0. Returns false if
+ * there are too many pins, or any of them does not exist or drives an LED. */
+bool SCANNER_discover_start(uint8_t npins, const uint8_t pins[]);
+/* Tests all the pin pairs once and returns the number of keys found so far;
+ * the keys are numbered in the order they were found. */
+uint8_t SCANNER_discover_step();
+/* Returns the key with the given number; a is the pin which was driven and b
+ * the one which was read, and the status is SCAN_OK_BI if the key conducts
+ * both ways (there is no diode). */
+const struct scan_result *SCANNER_get_key(uint8_t n);
+/* Writes the rows/cols/matrix tables for MATRIX_init() describing the keys
+ * found so far to buf: the number of rows, the number of columns, the row
+ * pins, the column pins and the key numbers in row-major order, with
+ * MATRIX_NO_KEY in empty positions. The pins of keys without diodes are put
+ * on the sides which the other keys sharing them need. Returns the number of
+ * bytes written, or 0 if they do not fit in size bytes or some pin would have
+ * to be both a row and a column, in which case only the keys can be used. */
+uint8_t SCANNER_get_matrix(uint8_t *buf, uint8_t size);
+void SCANNER_discover_stop();
+bool SCANNER_is_discovering();
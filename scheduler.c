@@ -0,0 +1,135 @@
+/* This file is part of ukbdc.
+ *
+ * ukbdc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ukbdc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ukbdc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "scheduler.h"
+#include "system.h"
+#include "timer.h"
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+static uint8_t fast_period, slow_period;
+static uint16_t quiet_time;
+/* number of ticks since the last activity */
+static volatile uint16_t quiet = 0;
+/* number of ticks since the last scan */
+static volatile uint8_t since_scan = 0;
+static volatile bool scan_due = false;
+/* ticks from a start-of-frame to the phase-locked scan, 0 if not locked */
+static uint8_t phase_delay = 0;
+static volatile uint32_t scan_end;
+static volatile bool scan_ended = false;
+static volatile struct scheduler_phase phase;
+
+void SCHEDULER_init(uint8_t fast_period_, uint8_t slow_period_,
+		uint16_t quiet_time_)
+{
+	fast_period = fast_period_;
+	slow_period = slow_period_;
+	quiet_time = quiet_time_;
+	quiet = 0;
+	since_scan = 0;
+	scan_due = true;
+}
+
+/* Counts one tick, returns true if a scan is due */
+static bool count_tick()
+{
+	if (quiet < quiet_time)
+		++quiet;
+	const uint8_t period = quiet < quiet_time ? fast_period : slow_period;
+	if (++since_scan < period)
+		return false;
+	since_scan = 0;
+	return true;
+}
+
+void SCHEDULER_tick()
+{
+	if (count_tick())
+		scan_due = true;
+}
+
+void SCHEDULER_handle_sof(void __attribute__((unused)) *data)
+{
+	if (scan_ended) {
+		scan_ended = false;
+		phase.last = TIMER_get_ticks() - scan_end;
+		if (phase.last > phase.worst)
+			phase.worst = phase.last;
+	}
+	if (!count_tick())
+		return;
+	if (phase_delay)
+		TIMER_set_alarm(phase_delay);
+	else
+		scan_due = true;
+}
+
+static void handle_alarm(void __attribute__((unused)) *data)
+{
+	scan_due = true;
+}
+
+void SCHEDULER_set_phase(uint16_t offset_us)
+{
+	static bool subscribed = false;
+	if (offset_us == 0 || offset_us >= FRAME_US) {
+		phase_delay = 0;
+		return;
+	}
+	phase_delay = (FRAME_US - offset_us) * TIMER_TICKS_PER_MS / 1000;
+	if (!subscribed) {
+		SYSTEM_subscribe(TIMER, TIMER_ALARM, handle_alarm);
+		subscribed = true;
+	}
+}
+
+void SCHEDULER_get_phase(struct scheduler_phase *phase_)
+{
+	uint8_t sreg = SREG;
+	cli();
+	*phase_ = phase;
+	SREG = sreg;
+}
+
+bool SCHEDULER_should_scan()
+{
+	if (!scan_due)
+		return false;
+	scan_due = false;
+	return true;
+}
+
+void SCHEDULER_scan_now()
+{
+	quiet = 0;
+	scan_due = true;
+}
+
+void SCHEDULER_report(bool active)
+{
+	const uint32_t now = TIMER_get_ticks();
+	/* the frame interrupt must not read half of the old value */
+	uint8_t sreg = SREG;
+	cli();
+	scan_end = now;
+	scan_ended = true;
+	SREG = sreg;
+	if (active)
+		quiet = 0;
+}
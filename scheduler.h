@@ -0,0 +1,95 @@
+/* This file is part of ukbdc.
+ *
+ * ukbdc is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ukbdc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ukbdc; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*! \defgroup SCHEDULER
+ * \brief Activity-driven matrix scan rate
+ *
+ * This module decides when the key matrix should be scanned. It is driven
+ * by a periodic tick, usually the USB start-of-frame, and scans at a fast
+ * rate as long as keys are changing state or held. After a configurable
+ * quiet period without any activity the scan rate is lowered, which saves
+ * CPU time and power while nobody is typing.
+ *
+ * After each scan the result should be reported with SCHEDULER_report(), so
+ * that the module knows whether the keyboard is in use.
+ *
+ * When the ticks come from SCHEDULER_handle_sof(), scans can also be
+ * phase-locked to the USB frames: instead of scanning right after a
+ * start-of-frame, the scan is scheduled with TIMER_set_alarm() a fixed time
+ * before the next one, so a changed report leaves in the very next frame.
+ * The achieved time between the end of a scan and the following
+ * start-of-frame is measured and can be read with SCHEDULER_get_phase().
+ *
+ * @{
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*! Length of a USB frame in microseconds */
+#define FRAME_US 1000
+
+/*! Time between the end of a scan and the following start-of-frame, in TIMER
+ * ticks */
+struct scheduler_phase {
+	/*! phase of the last scan */
+	uint16_t last;
+	/*! the longest phase seen so far */
+	uint16_t worst;
+};
+
+/*! Initializes the SCHEDULER module. This function must be called before any
+ * other function in this module.
+ * \param fast_period number of ticks between scans while keys are in use
+ * \param slow_period number of ticks between scans after the quiet period
+ * \param quiet_time number of ticks without activity after which the scan
+ * rate is lowered
+ */
+void SCHEDULER_init(uint8_t fast_period, uint8_t slow_period,
+		uint16_t quiet_time);
+/*! Advances the scheduler by one tick. This function is meant to be called
+ * from an interrupt handler, e.g. on every USB start-of-frame */
+void SCHEDULER_tick();
+/*! Advances the scheduler on a USB start-of-frame and measures the phase of
+ * the last scan. This function can be subscribed to the \ref USB_SOF
+ * message directly. */
+void SCHEDULER_handle_sof(void *data);
+/*! Locks the scans to the USB frames
+ * \param offset_us the time (in microseconds) before a start-of-frame at
+ * which the scan should run; `0` means scanning right after the
+ * start-of-frame
+ */
+void SCHEDULER_set_phase(uint16_t offset_us);
+/*! Reads the measured phase of the scans
+ * \param phase structure to fill
+ */
+void SCHEDULER_get_phase(struct scheduler_phase *phase);
+/*! Tests if a scan is due and clears the request
+ * \return `true` if the matrix should be scanned now
+ */
+bool SCHEDULER_should_scan();
+/*! Requests a scan on the next call to SCHEDULER_should_scan() and returns to
+ * the fast scan rate */
+void SCHEDULER_scan_now();
+/*! Reports the result of a scan
+ * \param active `true` if any key changed state or is held
+ */
+void SCHEDULER_report(bool active);
+
+/*! @} */
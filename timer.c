@@ -28,6 +28,7 @@ static volatile int ntmrs = 0;
 static volatile timer_t heap[MAX_TIMERS];
 static volatile bool heap_lock = false;
 static volatile bool id_taken[MAX_TIMERS];
+static uint8_t alarm_id = TIMER_ALARM;
 
 void TIMER_init()
 {
@@ -138,6 +139,35 @@ int8_t TIMER_delete(int8_t id)
 	return 0;
 }
 
+uint32_t TIMER_get_ticks()
+{
+	uint8_t sreg = SREG;
+	cli();
+	uint16_t tcnt = TCNT1;
+	uint16_t c = cycle;
+	/* the counter has overflowed, but the interrupt has not been served */
+	if (bit_is_set(TIFR1, TOV1) && tcnt < 0x8000)
+		++c;
+	SREG = sreg;
+	return ((uint32_t)c << 16) | tcnt;
+}
+
+void TIMER_set_alarm(uint16_t time)
+{
+	uint8_t sreg = SREG;
+	cli();
+	OCR1B = TCNT1 + time;
+	TIFR1 = _BV(OCF1B);
+	TIMSK1 |= _BV(OCIE1B);
+	SREG = sreg;
+}
+
+ISR(TIMER1_COMPB_vect)
+{
+	TIMSK1 &= ~_BV(OCIE1B);
+	SYSTEM_publish_message(TIMER, TIMER_ALARM, &alarm_id);
+}
+
 ISR(TIMER1_OVF_vect)
 {
 	while (heap_lock)
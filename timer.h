@@ -40,6 +40,13 @@
 /*! Error occuring when trying to delete a non-existent timer */
 #define ERR_NO_TIMER -2
 
+/*! The number of timer ticks in one millisecond */
+#define TIMER_TICKS_PER_MS 16
+
+/*! Subtype of the TIMER message published by the alarm set with
+ * TIMER_set_alarm() */
+#define TIMER_ALARM MAX_TIMERS
+
 /* parameters */
 #define CONTINUOUS	(1 << 0)
 #define DELETED		(1 << 1)
@@ -72,5 +79,16 @@ int8_t TIMER_add(uint32_t time, bool continuous);
  * \retval ERR_NO_TIMER timer does not exist
  */
 int8_t TIMER_delete(int8_t id);
+/*! Returns the current time
+ * \return number of ticks since TIMER_init()
+ */
+uint32_t TIMER_get_ticks();
+/*! Sets a single-shot alarm which publishes a TIMER message with subtype
+ * \ref TIMER_ALARM after `time` ticks. There is only one such alarm, setting
+ * it again replaces the previous one. The alarm uses a separate compare unit,
+ * so it is precise to a single tick regardless of the other timers.
+ * \param time the time (in ticks) after which the alarm will trigger
+ */
+void TIMER_set_alarm(uint16_t time);
 
 /*! @} */